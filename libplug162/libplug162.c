@@ -0,0 +1,619 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <libudev.h>
+
+#include "libplug162.h"
+
+#define PLUG162_SUBSYSTEM   "plug162"
+#define PLUG162_OLD_SUBSYSTEM "usbmisc"  /* drivers before the own class */
+#define PLUG162_SYSNAME     "plug162"
+#define PLUG162_READ_BATCH  16
+
+/*
+ * Batches go out of a ring of page sized segments, one write() each. The
+ * driver may send a batch straight from these pages after write() has
+ * returned, so a segment written since the last fsync() is busy until
+ * the next one; the ring waits for that before filling it again.
+ */
+#define PLUG162_SEG_SIZE    4096
+#define PLUG162_SEGS        8
+
+enum {
+    TAG_DEV,
+    TAG_PIPE,
+    TAG_MONITOR,
+};
+
+struct plug162 {
+    int                 fd;         /* device node, -1 while unplugged */
+    int                 epfd;
+    int                 legacy;     /* driver without poll(), see below */
+    int                 pipefd[2];
+    pthread_t           reader;
+    struct udev         *udev;
+    struct udev_monitor *mon;
+    char                serial[PLUG162_SERIAL_MAX];
+    char                devnode[PLUG162_DEVNODE_MAX];
+    struct plug162_callbacks cb;
+    void                *user;
+    struct plug162_caps caps;
+    unsigned char       *segs;
+    unsigned int        seg;        /* segment being filled */
+    size_t              seg_len;
+    size_t              seg_sent;
+    unsigned int        seg_busy;   /* mask of segments maybe in flight */
+};
+
+static int plug162_is_ours(struct udev_device *d)
+{
+    const char *name = udev_device_get_sysname(d);
+
+    return name && !strncmp(name, PLUG162_SYSNAME, strlen(PLUG162_SYSNAME));
+}
+
+static const char *plug162_serial_of(struct udev_device *d)
+{
+    struct udev_device *usb;
+    const char *serial;
+
+    serial = udev_device_get_sysattr_value(d, "serial");
+    if (serial && serial[0])
+        return serial;
+
+    /* drivers that predate the node's own attribute */
+    usb = udev_device_get_parent_with_subsystem_devtype(d, "usb",
+                                                        "usb_device");
+    serial = usb ? udev_device_get_sysattr_value(usb, "serial") : NULL;
+
+    return serial ? serial : "";
+}
+
+static int plug162_scan(struct udev *udev, struct plug162_info *info, int max)
+{
+    struct udev_enumerate *e;
+    struct udev_list_entry *entry;
+    struct udev_device *d;
+    const char *node;
+    int n = 0;
+
+    e = udev_enumerate_new(udev);
+    if (!e)
+        return -ENOMEM;
+
+    udev_enumerate_add_match_subsystem(e, PLUG162_SUBSYSTEM);
+    udev_enumerate_add_match_subsystem(e, PLUG162_OLD_SUBSYSTEM);
+    udev_enumerate_add_match_sysname(e, PLUG162_SYSNAME "*");
+    udev_enumerate_scan_devices(e);
+
+    udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(e)) {
+        if (n >= max)
+            break;
+        d = udev_device_new_from_syspath(udev,
+                                         udev_list_entry_get_name(entry));
+        if (!d)
+            continue;
+        node = udev_device_get_devnode(d);
+        if (node) {
+            snprintf(info[n].devnode, sizeof(info[n].devnode), "%s", node);
+            snprintf(info[n].serial, sizeof(info[n].serial), "%s",
+                     plug162_serial_of(d));
+            n++;
+        }
+        udev_device_unref(d);
+    }
+
+    udev_enumerate_unref(e);
+
+    return n;
+}
+
+int plug162_enumerate(struct plug162_info *info, int max)
+{
+    struct udev *udev;
+    int n;
+
+    udev = udev_new();
+    if (!udev)
+        return -ENOMEM;
+    n = plug162_scan(udev, info, max);
+    udev_unref(udev);
+
+    return n;
+}
+
+/*
+ * Drivers from before channels only do blocking reads and have no poll(),
+ * so a thread reads for them and forwards events through a pipe. A zero
+ * type tells the event loop that the device is gone.
+ */
+static void *plug162_reader_thread(void *arg)
+{
+    struct plug162 *p = arg;
+    unsigned char buf[PLUG162_CMD_SIZE];
+    struct plug162_event ev;
+    ssize_t n;
+
+    for (;;) {
+        n = read(p->fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        memset(&ev, 0, sizeof(ev));
+        if (n < 0)
+            break;
+        if (n == 0)
+            continue;
+        ev.type = buf[0];
+        if (write(p->pipefd[1], &ev, sizeof(ev)) < 0)
+            return NULL;
+    }
+
+    if (write(p->pipefd[1], &ev, sizeof(ev)) < 0)
+        return NULL;
+
+    return NULL;
+}
+
+static int plug162_attach(struct plug162 *p, const char *devnode)
+{
+    struct epoll_event ev;
+    int fd;
+    int rv;
+
+    fd = open(devnode, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    memset(&p->caps, 0, sizeof(p->caps));
+    p->legacy = 0;
+    if (ioctl(fd, PLUG162_IOC_GET_CAPS, &p->caps) < 0) {
+        if (errno != ENOTTY) {
+            rv = -errno;
+            close(fd);
+            return rv;
+        }
+        p->legacy = 1;
+        p->caps.num_leds = 1;
+        p->caps.num_buttons = 1;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    }
+
+    p->fd = fd;
+    snprintf(p->devnode, sizeof(p->devnode), "%s", devnode);
+    memset(&ev, 0, sizeof(ev));
+
+    if (p->legacy) {
+        if (pipe2(p->pipefd, O_CLOEXEC) < 0)
+            goto error;
+        fcntl(p->pipefd[0], F_SETFL, O_NONBLOCK);
+        if (pthread_create(&p->reader, NULL, plug162_reader_thread, p)) {
+            close(p->pipefd[0]);
+            close(p->pipefd[1]);
+            errno = EAGAIN;
+            goto error;
+        }
+        ev.events = EPOLLIN;
+        ev.data.u32 = TAG_PIPE;
+        epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->pipefd[0], &ev);
+    } else {
+        /* edge triggered: a sticky EPOLLERR must not spin the loop */
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u32 = TAG_DEV;
+        if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            goto error;
+    }
+
+    return 0;
+
+error:
+    rv = -errno;
+    close(fd);
+    p->fd = -1;
+    return rv;
+}
+
+static void plug162_detach(struct plug162 *p)
+{
+    if (p->fd < 0)
+        return;
+
+    if (p->legacy) {
+        pthread_cancel(p->reader);
+        pthread_join(p->reader, NULL);
+        epoll_ctl(p->epfd, EPOLL_CTL_DEL, p->pipefd[0], NULL);
+        close(p->pipefd[0]);
+        close(p->pipefd[1]);
+    } else {
+        epoll_ctl(p->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+    }
+
+    close(p->fd);
+    p->fd = -1;
+
+    /* commands meant for the old session are stale by now */
+    p->seg_len = 0;
+    p->seg_sent = 0;
+    p->seg_busy = 0;
+}
+
+/* @match as for plug162_open(); an empty serial matches any device */
+static int plug162_find(struct plug162 *p, const char *match)
+{
+    struct plug162_info info[32];
+    int n;
+    int i;
+
+    if (match && match[0] == '/')
+        return plug162_attach(p, match);
+
+    n = plug162_scan(p->udev, info, 32);
+    if (n < 0)
+        return n;
+
+    for (i = 0; i < n; i++) {
+        if (match && match[0] && strcmp(info[i].serial, match))
+            continue;
+        if (!plug162_attach(p, info[i].devnode)) {
+            snprintf(p->serial, sizeof(p->serial), "%s", info[i].serial);
+            return 0;
+        }
+    }
+
+    return -ENODEV;
+}
+
+static void plug162_reconnect(struct plug162 *p)
+{
+    const char *match = p->serial[0] ? p->serial : p->devnode;
+
+    if (p->fd >= 0 || plug162_find(p, match))
+        return;
+    if (p->cb.state)
+        p->cb.state(p, 1, p->user);
+}
+
+static void plug162_lost(struct plug162 *p)
+{
+    plug162_detach(p);
+    if (p->cb.state)
+        p->cb.state(p, 0, p->user);
+    /* it may still be there, e.g. after the driver gave up on recovery */
+    plug162_reconnect(p);
+}
+
+static void plug162_deliver(struct plug162 *p, const struct plug162_event *ev,
+                            size_t count)
+{
+    if (count && p->cb.events)
+        p->cb.events(p, ev, count, p->user);
+}
+
+static void plug162_read_events(struct plug162 *p)
+{
+    struct plug162_event ev[PLUG162_READ_BATCH];
+    ssize_t n;
+
+    while (p->fd >= 0) {
+        n = read(p->fd, ev, sizeof(ev));
+        if (n > 0) {
+            plug162_deliver(p, ev, n / sizeof(ev[0]));
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0 || errno == EAGAIN)
+            return;
+        plug162_lost(p);
+        return;
+    }
+}
+
+static void plug162_read_pipe(struct plug162 *p)
+{
+    struct plug162_event ev[PLUG162_READ_BATCH];
+    size_t count;
+    size_t i;
+    ssize_t n;
+
+    while (p->fd >= 0) {
+        n = read(p->pipefd[0], ev, sizeof(ev));
+        if (n <= 0)
+            return;
+        count = n / sizeof(ev[0]);
+        for (i = 0; i < count; i++) {
+            if (!ev[i].type) {
+                plug162_deliver(p, ev, i);
+                plug162_lost(p);
+                return;
+            }
+        }
+        plug162_deliver(p, ev, count);
+    }
+}
+
+static void plug162_handle_uevent(struct plug162 *p)
+{
+    struct udev_device *d;
+    const char *action;
+
+    d = udev_monitor_receive_device(p->mon);
+    if (!d)
+        return;
+
+    action = udev_device_get_action(d);
+    if (p->fd < 0 && action && !strcmp(action, "add") && plug162_is_ours(d))
+        plug162_reconnect(p);
+
+    udev_device_unref(d);
+}
+
+struct plug162 *plug162_open(const char *match,
+                             const struct plug162_callbacks *cb, void *user)
+{
+    struct epoll_event ev;
+    struct plug162 *p;
+
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        return NULL;
+    p->fd = -1;
+    p->epfd = -1;
+    if (cb)
+        p->cb = *cb;
+    p->user = user;
+
+    if (posix_memalign((void **)&p->segs, PLUG162_SEG_SIZE,
+                       PLUG162_SEG_SIZE * PLUG162_SEGS))
+        goto error;
+
+    p->epfd = epoll_create1(EPOLL_CLOEXEC);
+    p->udev = udev_new();
+    if (p->epfd < 0 || !p->udev)
+        goto error;
+
+    p->mon = udev_monitor_new_from_netlink(p->udev, "udev");
+    if (p->mon) {
+        udev_monitor_filter_add_match_subsystem_devtype(p->mon,
+                PLUG162_SUBSYSTEM, NULL);
+        udev_monitor_filter_add_match_subsystem_devtype(p->mon,
+                PLUG162_OLD_SUBSYSTEM, NULL);
+        udev_monitor_enable_receiving(p->mon);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = TAG_MONITOR;
+        epoll_ctl(p->epfd, EPOLL_CTL_ADD, udev_monitor_get_fd(p->mon), &ev);
+    }
+
+    if (plug162_find(p, match))
+        goto error;
+
+    /* opened by node: learn the serial so a replug is found again */
+    if (match && match[0] == '/') {
+        struct udev_device *d;
+        struct stat st;
+
+        if (!fstat(p->fd, &st)) {
+            d = udev_device_new_from_devnum(p->udev, 'c', st.st_rdev);
+            if (d) {
+                snprintf(p->serial, sizeof(p->serial), "%s",
+                         plug162_serial_of(d));
+                udev_device_unref(d);
+            }
+        }
+    }
+
+    return p;
+
+error:
+    plug162_close(p);
+    return NULL;
+}
+
+void plug162_close(struct plug162 *p)
+{
+    if (!p)
+        return;
+
+    plug162_detach(p);
+    if (p->mon)
+        udev_monitor_unref(p->mon);
+    if (p->udev)
+        udev_unref(p->udev);
+    if (p->epfd >= 0)
+        close(p->epfd);
+    free(p->segs);
+    free(p);
+}
+
+int plug162_fd(struct plug162 *p)
+{
+    return p->epfd;
+}
+
+int plug162_dispatch(struct plug162 *p, int timeout_ms)
+{
+    struct epoll_event ev[4];
+    int n;
+    int i;
+
+    n = epoll_wait(p->epfd, ev, 4, timeout_ms);
+    if (n < 0)
+        return errno == EINTR ? 0 : -errno;
+
+    for (i = 0; i < n; i++) {
+        switch (ev[i].data.u32) {
+        case TAG_DEV:
+            plug162_read_events(p);
+            if (p->fd >= 0 && (ev[i].events & EPOLLOUT))
+                plug162_flush(p);
+            break;
+        case TAG_PIPE:
+            plug162_read_pipe(p);
+            break;
+        case TAG_MONITOR:
+            plug162_handle_uevent(p);
+            break;
+        }
+    }
+
+    return n;
+}
+
+int plug162_connected(struct plug162 *p)
+{
+    return p->fd >= 0;
+}
+
+int plug162_get_caps(struct plug162 *p, struct plug162_caps *caps)
+{
+    if (p->fd < 0)
+        return -ENODEV;
+    *caps = p->caps;
+
+    return 0;
+}
+
+int plug162_set_channels(struct plug162 *p, __u32 mask)
+{
+    if (p->fd < 0)
+        return -ENODEV;
+    if (ioctl(p->fd, PLUG162_IOC_SET_CHANNELS, &mask) < 0)
+        return -errno;
+
+    return 0;
+}
+
+int plug162_set_gesture(struct plug162 *p, const struct plug162_gesture *g)
+{
+    if (p->fd < 0)
+        return -ENODEV;
+    if (ioctl(p->fd, PLUG162_IOC_SET_GESTURE, g) < 0)
+        return -errno;
+
+    return 0;
+}
+
+int plug162_set_moderation(struct plug162 *p,
+                           const struct plug162_moderation *m)
+{
+    if (p->fd < 0)
+        return -ENODEV;
+    if (ioctl(p->fd, PLUG162_IOC_SET_MODERATION, m) < 0)
+        return -errno;
+
+    return 0;
+}
+
+int plug162_set_priority(struct plug162 *p, __u32 flags)
+{
+    if (p->fd < 0)
+        return -ENODEV;
+    if (ioctl(p->fd, PLUG162_IOC_SET_PRIORITY, &flags) < 0)
+        return -errno;
+
+    return 0;
+}
+
+int plug162_flush(struct plug162 *p)
+{
+    unsigned char *buf = p->segs + p->seg * PLUG162_SEG_SIZE;
+    ssize_t n;
+
+    if (p->fd < 0)
+        return -ENODEV;
+
+    while (p->seg_sent < p->seg_len) {
+        n = write(p->fd, buf + p->seg_sent, p->seg_len - p->seg_sent);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return 0;   /* the rest goes out on EPOLLOUT */
+        if (n < 0)
+            return -errno;
+        p->seg_sent += n;
+        p->seg_busy |= 1U << p->seg;
+    }
+
+    if (p->seg_len) {
+        p->seg = (p->seg + 1) % PLUG162_SEGS;
+        p->seg_len = 0;
+        p->seg_sent = 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Waits until the driver is done with every segment written so far. A
+ * driver without fsync() copies what it is given, so nothing is busy.
+ */
+static int plug162_wait_segs(struct plug162 *p)
+{
+    int rv = 0;
+
+    if (fsync(p->fd) < 0) {
+        rv = -errno;
+        /* the writes are still in flight */
+        if (rv == -EINTR || rv == -ETIMEDOUT)
+            return rv;
+        if (rv == -EINVAL)
+            rv = 0;
+    }
+    p->seg_busy = 0;
+
+    return rv;
+}
+
+static int plug162_queue(struct plug162 *p, __u8 op, __u8 a, __u8 b)
+{
+    unsigned char *pkt;
+    int rv;
+
+    if (p->fd < 0)
+        return -ENODEV;
+
+    if (p->seg_len + PLUG162_CMD_SIZE > PLUG162_SEG_SIZE) {
+        rv = plug162_flush(p);
+        if (rv < 0)
+            return rv;
+        if (p->seg_len)
+            return -EAGAIN;
+    }
+    if (!p->seg_len && (p->seg_busy & (1U << p->seg))) {
+        rv = plug162_wait_segs(p);
+        if (rv < 0)
+            return rv;
+    }
+
+    pkt = p->segs + p->seg * PLUG162_SEG_SIZE + p->seg_len;
+    memset(pkt, 0, PLUG162_CMD_SIZE);
+    pkt[0] = op;
+    pkt[1] = a;
+    pkt[2] = b;
+    p->seg_len += PLUG162_CMD_SIZE;
+
+    return 0;
+}
+
+int plug162_led_on(struct plug162 *p, unsigned int channel)
+{
+    return plug162_queue(p, LED_ON, channel, 0);
+}
+
+int plug162_led_off(struct plug162 *p, unsigned int channel)
+{
+    return plug162_queue(p, LED_OFF, channel, 0);
+}
+
+int plug162_led_set(struct plug162 *p, __u8 channels, __u8 values)
+{
+    return plug162_queue(p, LED_SET, channels, values);
+}
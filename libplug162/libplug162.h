@@ -0,0 +1,88 @@
+#ifndef _LIBPLUG162_
+#define _LIBPLUG162_
+
+#include <stddef.h>
+#include <linux/types.h>
+
+#include "protocol.h"
+#include "plug162_ioctl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Every command is sent as one OUT packet; the driver splits a write into
+ * packets of the endpoint size, so batched commands are padded to it.
+ */
+#define PLUG162_CMD_SIZE        8
+#define PLUG162_SERIAL_MAX      64
+#define PLUG162_DEVNODE_MAX     64
+
+struct plug162;
+
+struct plug162_info {
+    char    devnode[PLUG162_DEVNODE_MAX];
+    char    serial[PLUG162_SERIAL_MAX];
+};
+
+struct plug162_callbacks {
+    /* a batch of button events, oldest first */
+    void (*events)(struct plug162 *p, const struct plug162_event *ev,
+                   size_t count, void *user);
+    /* the device went away (0) or came back and was reopened (1) */
+    void (*state)(struct plug162 *p, int connected, void *user);
+};
+
+/* fills up to @max entries and returns the number of devices found */
+int plug162_enumerate(struct plug162_info *info, int max);
+
+/*
+ * @match is a device node (starting with '/'), a serial number, or NULL
+ * for the first device found. A device matched by serial is reopened
+ * automatically when it is plugged back in.
+ */
+struct plug162 *plug162_open(const char *match,
+                             const struct plug162_callbacks *cb, void *user);
+void plug162_close(struct plug162 *p);
+
+/*
+ * A descriptor that becomes readable whenever plug162_dispatch() has work,
+ * for adding to the caller's own poll/epoll/event loop.
+ */
+int plug162_fd(struct plug162 *p);
+
+/* handles pending I/O, invoking the callbacks; waits up to @timeout_ms */
+int plug162_dispatch(struct plug162 *p, int timeout_ms);
+
+int plug162_connected(struct plug162 *p);
+int plug162_get_caps(struct plug162 *p, struct plug162_caps *caps);
+int plug162_set_channels(struct plug162 *p, __u32 mask);
+/* debounce, long press and double press timing, in ms; 0 disables one */
+int plug162_set_gesture(struct plug162 *p, const struct plug162_gesture *g);
+/* batches events into fewer wakeups, see struct plug162_moderation */
+int plug162_set_moderation(struct plug162 *p,
+                           const struct plug162_moderation *m);
+/*
+ * PLUG162_PRIO_* for this handle's writes. An urgent handle writes one
+ * packet at a time, so keep a second one for the routine commands.
+ */
+int plug162_set_priority(struct plug162 *p, __u32 flags);
+
+/*
+ * Commands are queued and go out together, in one write(), on
+ * plug162_flush(). Whatever the driver cannot take yet is sent from
+ * plug162_dispatch() once it can. Once the batches wrap around the
+ * ring, queueing a command may wait in fsync() for the driver to finish
+ * with earlier ones, and returns its error if one of them failed.
+ */
+int plug162_led_on(struct plug162 *p, unsigned int channel);
+int plug162_led_off(struct plug162 *p, unsigned int channel);
+int plug162_led_set(struct plug162 *p, __u8 channels, __u8 values);
+int plug162_flush(struct plug162 *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <cerrno>
+#include <functional>
+#include <memory>
+#include <span>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "libplug162.h"
+
+namespace libplug162 {
+
+/*
+ * Thin RAII wrapper around struct plug162. Add fd() to the service's own
+ * event loop and call dispatch() when it is readable; the handlers run
+ * from dispatch(), on the caller's thread.
+ */
+class Device {
+public:
+    using EventHandler = std::function<void(std::span<const plug162_event>)>;
+    using StateHandler = std::function<void(bool connected)>;
+
+    explicit Device(const std::string &match = {},
+                    EventHandler on_events = {}, StateHandler on_state = {})
+        : on_events_(std::move(on_events)), on_state_(std::move(on_state))
+    {
+        static const plug162_callbacks cb = { &Device::events_cb,
+                                              &Device::state_cb };
+
+        p_.reset(plug162_open(match.empty() ? nullptr : match.c_str(),
+                              &cb, this));
+        if (!p_)
+            throw std::system_error(errno ? errno : ENODEV,
+                                    std::generic_category(), "plug162_open");
+    }
+
+    /* the callbacks hold on to this */
+    Device(const Device &) = delete;
+    Device &operator=(const Device &) = delete;
+
+    static std::vector<plug162_info> enumerate(int max = 32)
+    {
+        std::vector<plug162_info> info(max);
+        int n = plug162_enumerate(info.data(), max);
+
+        check(n, "plug162_enumerate");
+        info.resize(n);
+        return info;
+    }
+
+    int fd() const { return plug162_fd(p_.get()); }
+    bool connected() const { return plug162_connected(p_.get()); }
+
+    int dispatch(int timeout_ms = 0)
+    {
+        return check(plug162_dispatch(p_.get(), timeout_ms),
+                     "plug162_dispatch");
+    }
+
+    plug162_caps caps() const
+    {
+        plug162_caps caps;
+
+        check(plug162_get_caps(p_.get(), &caps), "plug162_get_caps");
+        return caps;
+    }
+
+    void set_channels(__u32 mask)
+    {
+        check(plug162_set_channels(p_.get(), mask), "plug162_set_channels");
+    }
+
+    void set_gesture(const plug162_gesture &g)
+    {
+        check(plug162_set_gesture(p_.get(), &g), "plug162_set_gesture");
+    }
+
+    void set_moderation(const plug162_moderation &m)
+    {
+        check(plug162_set_moderation(p_.get(), &m), "plug162_set_moderation");
+    }
+
+    void set_priority(__u32 flags)
+    {
+        check(plug162_set_priority(p_.get(), flags), "plug162_set_priority");
+    }
+
+    void led_on(unsigned int channel)
+    {
+        check(plug162_led_on(p_.get(), channel), "plug162_led_on");
+    }
+
+    void led_off(unsigned int channel)
+    {
+        check(plug162_led_off(p_.get(), channel), "plug162_led_off");
+    }
+
+    void led_set(__u8 channels, __u8 values)
+    {
+        check(plug162_led_set(p_.get(), channels, values), "plug162_led_set");
+    }
+
+    void flush() { check(plug162_flush(p_.get()), "plug162_flush"); }
+
+private:
+    struct Closer {
+        void operator()(struct plug162 *p) const { plug162_close(p); }
+    };
+
+    static int check(int rv, const char *what)
+    {
+        if (rv < 0)
+            throw std::system_error(-rv, std::generic_category(), what);
+        return rv;
+    }
+
+    static void events_cb(struct plug162 *, const plug162_event *ev,
+                          size_t count, void *user)
+    {
+        auto *self = static_cast<Device *>(user);
+
+        if (self->on_events_)
+            self->on_events_(std::span<const plug162_event>(ev, count));
+    }
+
+    static void state_cb(struct plug162 *, int connected, void *user)
+    {
+        auto *self = static_cast<Device *>(user);
+
+        if (self->on_state_)
+            self->on_state_(connected != 0);
+    }
+
+    EventHandler on_events_;
+    StateHandler on_state_;
+    std::unique_ptr<struct plug162, Closer> p_;
+};
+
+} // namespace libplug162
@@ -10,6 +10,7 @@
 #include <avr/wdt.h>
 #include <avr/power.h>
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 
 #include "plug162.h"
 #include "descriptors.h"
@@ -31,12 +32,78 @@ struct plug162_device_setup dev = {
                           }
 };
 
-bool button_down_prev = false;
+static struct plug162_caps_desc caps = {
+    .bLength            = sizeof(struct plug162_caps_desc),
+    .bVersion           = CAPS_VERSION,
+    .bNumLeds           = NUM_LED_CHANNELS,
+    .bNumButtons        = NUM_BUTTON_CHANNELS
+};
+
+static const uint8_t led_masks[NUM_LED_CHANNELS] = LED_CHANNEL_MASKS;
+static const uint8_t button_masks[NUM_BUTTON_CHANNELS] = BUTTON_CHANNEL_MASKS;
+
+uint8_t led_state = 0;      /* one bit per LED channel */
+uint8_t button_state = 0;   /* one bit per button channel */
 uint16_t in_ep_remain_ms = 0;
-uint16_t button_remain_ms = 0; 
+volatile uint32_t ms_now = 0;  /* counted by the 1 ms SOF tick */
+volatile uint16_t timer1_overflows = 0;
+
+struct gesture gestures[NUM_BUTTON_CHANNELS];
+struct gesture_config gesture_config = {
+    .debounce_ms        = GESTURE_DEBOUNCE,
+    .long_press_ms      = GESTURE_LONG_PRESS,
+    .double_gap_ms      = GESTURE_DOUBLE_GAP
+};
+
+struct plug162_telemetry telemetry = {
+    .bLength            = sizeof(struct plug162_telemetry),
+    .bVersion           = TELEMETRY_VERSION
+};
+uint8_t buttons_raw = 0;    /* Buttons_GetStatus() at the last poll */
+
+/* events waiting for the IN endpoint, sent a packet's worth at a time */
+uint8_t event_buf[EVENT_QUEUE_SIZE];
+uint8_t event_len = 0;
+
+/* for the 16 bit telemetry counts, which stick at their maximum */
+#define COUNT(c) do { if ((c) != UINT16_MAX) (c)++; } while (0)
+
+static uint32_t micros(void);
+static uint32_t millis(void);
+static void queue_event(uint8_t type, uint8_t channel, uint32_t ms);
 
 void EVENT_USB_Device_ControlRequest(void)
 {
+    uint8_t status[2];
+
+    if (USB_ControlRequest.bmRequestType !=
+        (REQDIR_DEVICETOHOST | REQTYPE_VENDOR | REQREC_INTERFACE))
+        return;
+
+    switch (USB_ControlRequest.bRequest) {
+    case REQ_GET_CAPS:
+        Endpoint_ClearSETUP();
+        Endpoint_Write_Control_Stream_LE(&caps, sizeof(caps));
+        Endpoint_ClearOUT();
+        break;
+    case REQ_GET_STATUS:
+        status[0] = led_state;
+        status[1] = button_state;
+        Endpoint_ClearSETUP();
+        Endpoint_Write_Control_Stream_LE(status, sizeof(status));
+        Endpoint_ClearOUT();
+        break;
+    case REQ_GET_TELEMETRY:
+        telemetry.dSofs = millis();
+        Endpoint_ClearSETUP();
+        Endpoint_Write_Control_Stream_LE(&telemetry, sizeof(telemetry));
+        Endpoint_ClearOUT();
+        if (USB_ControlRequest.wValue & TELEMETRY_CLEAR_MAX)
+            telemetry.wWorkMaxUs = 0;
+        break;
+    default:
+        break;
+    }
 }
 
 void EVENT_USB_Device_Connect(void)
@@ -51,14 +118,69 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 {
     Endpoint_ConfigureEndpointTable(&dev.out_led_ep, 1);
     Endpoint_ConfigureEndpointTable(&dev.in_button_ep, 1);
+
+    /* how long the first enumeration took, reported in the caps */
+    if (!caps.wReadyMs) {
+        uint32_t ms = micros() / 1000;
+
+        caps.wReadyMs = (ms > 0xffff) ? 0xffff : (ms ? ms : 1);
+    }
 }
 
 void EVENT_USB_Device_StartOfFrame(void)
 {
     if (in_ep_remain_ms)
         in_ep_remain_ms--;
-    if (button_remain_ms)
-        button_remain_ms--;
+    ms_now++;
+}
+
+ISR(TIMER1_OVF_vect)
+{
+    timer1_overflows++;
+}
+
+/* time since SetupHardware() started Timer1, wrapping after ~71 minutes */
+static uint32_t micros(void)
+{
+    uint16_t overflows;
+    uint16_t ticks;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        ticks = TCNT1;
+        overflows = timer1_overflows;
+        /* an overflow not yet counted by the ISR */
+        if ((TIFR1 & (1 << TOV1)) && ticks < 0x8000)
+            overflows++;
+    }
+
+    return (((uint32_t)overflows << 16) | ticks) * TIMER1_US_PER_TICK;
+}
+
+static uint32_t millis(void)
+{
+    uint32_t now;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        now = ms_now;
+    }
+
+    return now;
+}
+
+static void wait_inputs_stable(void)
+{
+    uint8_t last = Buttons_GetStatus();
+    uint8_t same = 0;
+    uint8_t ms;
+
+    for (ms = 0; ms < INPUT_STABLE_TIMEOUT && same < INPUT_STABLE_SAMPLES; ms++) {
+        uint8_t now;
+
+        _delay_ms(1);
+        now = Buttons_GetStatus();
+        same = (now == last) ? same + 1 : 0;
+        last = now;
+    }
 }
 
 void SetupHardware(void)
@@ -67,72 +189,209 @@ void SetupHardware(void)
     MCUSR &= ~(1 << WDRF);
     wdt_disable();
 
+    TCCR1A = 0;
+    TCCR1B = (1 << CS11) | (1 << CS10);
+    TIMSK1 = (1 << TOIE1);
+
     /* Hardware Initialization */
     LEDs_Init();
     Buttons_Init();
+    wait_inputs_stable();
     USB_Init();
     USB_Device_EnableSOFEvents();
 }
 
 
-static register_button_down()
+/* update the LEDs of all channels in @channels with a single port write */
+static void set_leds(uint8_t channels, uint8_t values)
 {
-    if (Endpoint_BytesInEndpoint())
-        Endpoint_AbortPendingIN();
+    uint8_t port_mask = 0;
+    uint8_t port_on = 0;
+    uint8_t i;
 
-    if (Endpoint_IsReadWriteAllowed()) {
-        Endpoint_Write_8(BUTTON_DOWN);
-        Endpoint_ClearIN();
-        in_ep_remain_ms = IN_BUTTON_EP_POLL;
+    for (i = 0; i < NUM_LED_CHANNELS; i++) {
+        if (!(channels & (1 << i)))
+            continue;
+        port_mask |= led_masks[i];
+        if (values & (1 << i))
+            port_on |= led_masks[i];
     }
+
+    LEDs_ChangeLEDs(port_mask, port_on);
+    led_state = (led_state & ~channels) | (values & channels);
 }
 
-void plug162_do_work(void)
+static void handle_command(const uint8_t *cmd, uint8_t len)
 {
-    uint8_t button_down;
+    uint8_t channel = (len > 1) ? cmd[1] : 0;
 
+    switch (cmd[0]) {
+    case LED_OFF:
+        if (channel < NUM_LED_CHANNELS)
+            set_leds(1 << channel, 0);
+        break;
+    case LED_ON:
+        if (channel < NUM_LED_CHANNELS)
+            set_leds(1 << channel, 1 << channel);
+        break;
+    case LED_SET:
+        if (len >= 3)
+            set_leds(cmd[1], cmd[2]);
+        break;
+    case GESTURE_CONFIG:
+        if (len < 7)
+            break;
+        gesture_config.debounce_ms = cmd[1] | (cmd[2] << 8);
+        gesture_config.long_press_ms = cmd[3] | (cmd[4] << 8);
+        gesture_config.double_gap_ms = cmd[5] | (cmd[6] << 8);
+        break;
+    case PING:
+        queue_event(PONG, channel, USB_Device_GetFrameNumber());
+        break;
+    default:
+        COUNT(telemetry.wUnknownOps);
+        break;
+    }
+}
+
+static void queue_event(uint8_t type, uint8_t channel, uint32_t ms)
+{
+    uint16_t arg = (ms > 0xffff) ? 0xffff : ms;
+
+    /* the host is not keeping up; drop the newest */
+    if (event_len + EVENT_SIZE > sizeof(event_buf)) {
+        COUNT(telemetry.wEventsDropped);
+        return;
+    }
+
+    event_buf[event_len++] = type;
+    event_buf[event_len++] = channel;
+    event_buf[event_len++] = arg & 0xff;
+    event_buf[event_len++] = arg >> 8;
+}
+
+static void send_events(void)
+{
+    uint8_t len = (event_len < IN_BUTTON_EP_SIZE) ? event_len : IN_BUTTON_EP_SIZE;
+    uint8_t i;
+
+    if (!event_len || !Endpoint_IsReadWriteAllowed())
+        return;
+
+    for (i = 0; i < len; i++)
+        Endpoint_Write_8(event_buf[i]);
+    Endpoint_ClearIN();
+    in_ep_remain_ms = IN_BUTTON_EP_POLL;
+
+    event_len -= len;
+    for (i = 0; i < event_len; i++)
+        event_buf[i] = event_buf[i + len];
+}
+
+/*
+ * Edges closer than the debounce time to the previous one are ignored. A
+ * press is reported at once, a long press once it has been held for the
+ * long press time, and a double press when it follows the release of a
+ * short press within the double press gap.
+ */
+static void poll_gesture(uint8_t channel, bool down, uint32_t now)
+{
+    struct gesture *g = &gestures[channel];
+    uint32_t elapsed = now - g->since;
+
+    if (elapsed < gesture_config.debounce_ms)
+        return;
+
+    switch (g->state) {
+    case GESTURE_IDLE:
+        if (!down)
+            break;
+        queue_event(BUTTON_DOWN, channel, 0);
+        g->doubled = g->double_armed && gesture_config.double_gap_ms &&
+                     elapsed <= gesture_config.double_gap_ms;
+        if (g->doubled)
+            queue_event(BUTTON_DOUBLE_PRESS, channel, elapsed);
+        g->state = GESTURE_DOWN;
+        g->since = now;
+        button_state |= 1 << channel;
+        break;
+    case GESTURE_DOWN:
+    case GESTURE_LONG:
+        if (!down) {
+            queue_event(BUTTON_RELEASE, channel, elapsed);
+            g->double_armed = g->state == GESTURE_DOWN && !g->doubled;
+            g->state = GESTURE_IDLE;
+            g->since = now;
+            button_state &= ~(1 << channel);
+        } else if (g->state == GESTURE_DOWN && gesture_config.long_press_ms &&
+                   elapsed >= gesture_config.long_press_ms) {
+            queue_event(BUTTON_LONG_PRESS, channel, elapsed);
+            g->state = GESTURE_LONG;
+        }
+        break;
+    }
+}
+
+static void poll_buttons(void)
+{
+    uint8_t pressed = Buttons_GetStatus();
+    uint32_t now = millis();
+    uint8_t i;
+
+    for (i = 0; i < NUM_BUTTON_CHANNELS; i++) {
+        if ((pressed ^ buttons_raw) & button_masks[i])
+            COUNT(telemetry.wButtonEdges);
+        poll_gesture(i, pressed & button_masks[i], now);
+    }
+    buttons_raw = pressed;
+}
+
+static void do_work(void)
+{
     if (USB_DeviceState != DEVICE_STATE_Configured)
         return;
     
     Endpoint_SelectEndpoint(dev.out_led_ep.Address);
     
     if (Endpoint_IsReadWriteAllowed()) {
-        uint8_t in_data = 0;
+        uint8_t cmd[OUT_LED_EP_SIZE];
+        uint8_t len = Endpoint_BytesInEndpoint();
+        uint8_t i;
 
-        in_data = Endpoint_Read_8();
+        for (i = 0; i < len && i < sizeof(cmd); i++)
+            cmd[i] = Endpoint_Read_8();
         Endpoint_ClearOUT();
 
-        switch (in_data) {
-        case LED_OFF:
-            LEDs_TurnOffLEDs((1 << 4));
-            break;
-        case LED_ON:
-            LEDs_TurnOnLEDs((1 << 4));
-            break;
-        default:
-            break;
-        }
+        if (len)
+            handle_command(cmd, i);
     }
    
     Endpoint_SelectEndpoint(dev.in_button_ep.Address);
 
-    if (Endpoint_BytesInEndpoint() && !in_ep_remain_ms)
+    if (Endpoint_BytesInEndpoint() && !in_ep_remain_ms) {
         Endpoint_AbortPendingIN(); 
-
-    button_down = Buttons_GetStatus();
-    if (!button_down && button_down_prev) {
-        button_down_prev = false;
-        button_remain_ms = BUTTON_RELEASE_TIME;
-    } else if (button_down && !button_down_prev) {
-        button_down_prev = true;
-        if(!button_remain_ms)
-            register_button_down();
+        COUNT(telemetry.wInAborted);
     }
+
+    poll_buttons();
+    send_events();
+}
+
+void plug162_do_work(void)
+{
+    uint32_t start = micros();
+    uint32_t took;
+
+    do_work();
+
+    took = micros() - start;
+    if (took > telemetry.wWorkMaxUs)
+        telemetry.wWorkMaxUs = (took > UINT16_MAX) ? UINT16_MAX : took;
+    telemetry.dLoops++;
 }
             
 int main(void)
 {
-    _delay_ms(1000);
     SetupHardware();
     
     sei();
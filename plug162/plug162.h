@@ -1,11 +1,35 @@
 #ifndef _PLUG162_
 #define _PLUG162_
 
-#define LED_OFF   0x01
-#define LED_ON    0x02
+#include "protocol.h"
 
-#define BUTTON_DOWN 0x01
-#define BUTTON_RELEASE_TIME 100 /* 100ms */
+/* bytes of events buffered while the host is not polling */
+#define EVENT_QUEUE_SIZE        (4 * IN_BUTTON_EP_SIZE)
+
+/*
+ * Instead of a fixed start-up delay, USB is attached once the button
+ * inputs have read the same for INPUT_STABLE_SAMPLES ms in a row, giving
+ * up on them after INPUT_STABLE_TIMEOUT ms.
+ */
+#define INPUT_STABLE_SAMPLES    5
+#define INPUT_STABLE_TIMEOUT    50
+
+/* Timer1 runs free at F_CPU / 64 */
+#define TIMER1_US_PER_TICK      (64 / (F_CPU / 1000000UL))
+
+/* gesture timing until the host sends GESTURE_CONFIG, in ms */
+#define GESTURE_DEBOUNCE        20
+#define GESTURE_LONG_PRESS      800
+#define GESTURE_DOUBLE_GAP      300
+
+/*
+ * Port bits of each channel, in channel order. Boards with more I/O list
+ * their extra LEDs and buttons here.
+ */
+#define NUM_LED_CHANNELS        1
+#define LED_CHANNEL_MASKS       { (1 << 4) }
+#define NUM_BUTTON_CHANNELS     1
+#define BUTTON_CHANNEL_MASKS    { BUTTONS_BUTTON1 }
 
 struct plug162_device_setup {
     uint8_t                 intf_number;
@@ -14,6 +38,47 @@ struct plug162_device_setup {
     USB_Endpoint_Table_t    in_button_ep;
 };
 
+enum gesture_state {
+    GESTURE_IDLE,
+    GESTURE_DOWN,
+    GESTURE_LONG,           /* BUTTON_LONG_PRESS already sent */
+};
+
+struct gesture {
+    uint8_t     state;
+    bool        double_armed;   /* a release may start a double press */
+    bool        doubled;        /* this press was a double press */
+    uint32_t    since;          /* ms_now at the last accepted edge */
+};
+
+struct gesture_config {
+    uint16_t    debounce_ms;
+    uint16_t    long_press_ms;
+    uint16_t    double_gap_ms;
+};
+
+/* capability descriptor, see REQ_GET_CAPS in protocol.h */
+struct plug162_caps_desc {
+    uint8_t     bLength;
+    uint8_t     bVersion;
+    uint8_t     bNumLeds;
+    uint8_t     bNumButtons;
+    uint16_t    wReadyMs;
+};
+
+/* see REQ_GET_TELEMETRY in protocol.h, the 16 bit counts saturate */
+struct plug162_telemetry {
+    uint8_t     bLength;
+    uint8_t     bVersion;
+    uint16_t    wWorkMaxUs;     /* longest plug162_do_work() */
+    uint32_t    dLoops;         /* main loop iterations */
+    uint32_t    dSofs;          /* filled in from ms_now when read */
+    uint16_t    wInAborted;     /* IN packets the host never collected */
+    uint16_t    wUnknownOps;    /* OUT packets with an unknown opcode */
+    uint16_t    wButtonEdges;   /* raw input changes, bounces included */
+    uint16_t    wEventsDropped; /* event queue full */
+};
+
 void SetupHardware(void);
 
 
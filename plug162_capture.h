@@ -0,0 +1,32 @@
+#ifndef _PLUG162_CAPTURE_
+#define _PLUG162_CAPTURE_
+
+#include <linux/types.h>
+
+/*
+ * Traffic capture, read from debugfs as plug162/plug162N/capture when the
+ * module is loaded with capture_kb set. A read drains the capture ring; a
+ * file starts with the header and is followed by records, each directly
+ * followed by its len bytes of packet data.
+ */
+#define PLUG162_CAPTURE_MAGIC   0x32363150  /* "P162" */
+#define PLUG162_CAPTURE_VERSION 1
+
+#define PLUG162_CAPTURE_OUT     0   /* a write, as submitted */
+#define PLUG162_CAPTURE_IN      1   /* an int-in packet, as completed */
+
+struct plug162_capture_header {
+    __u32   magic;
+    __u16   version;
+    __u16   record_size;    /* sizeof(struct plug162_capture_record) */
+};
+
+struct plug162_capture_record {
+    __u64   ts_ns;          /* CLOCK_MONOTONIC */
+    __u16   len;
+    __u8    dir;
+    __u8    reserved;
+    __u32   dropped;        /* records lost to a full ring just before */
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef _PLUG162_IOCTL_
+#define _PLUG162_IOCTL_
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * One write() on /dev/plug162N sends at most this many pages of commands
+ * and returns the short count for the rest. It returns once the transfer
+ * is submitted: EPOLLOUT only means a slot is free again, and fsync()
+ * waits until every write submitted so far has completed. There is no
+ * completion for a single write; a failed one is reported, for the whole
+ * device, by the next write() or fsync().
+ */
+#define PLUG162_MAX_WRITE_PAGES 3
+
+/* one button event, as returned by read() on /dev/plug162N */
+struct plug162_event {
+    __u8    type;       /* BUTTON_DOWN, ... from protocol.h */
+    __u8    channel;
+    __u16   arg;
+};
+
+struct plug162_caps {
+    __u8    version;    /* 0 if the firmware has no capability descriptor */
+    __u8    num_leds;
+    __u8    num_buttons;
+    __u8    reserved;
+};
+
+/* gesture timing, see GESTURE_CONFIG in protocol.h */
+struct plug162_gesture {
+    __u16   debounce_ms;
+    __u16   long_press_ms;
+    __u16   double_gap_ms;
+    __u16   reserved;
+};
+
+/*
+ * When a blocked reader or poller of a file is woken: once batch_events
+ * events are queued for it, or max_latency_us after the first of them,
+ * whichever comes first. All zero, the default, wakes on every event.
+ * Events counted for a file may still be taken by another reader of the
+ * same channel, see PLUG162_IOC_SET_CHANNELS.
+ */
+struct plug162_moderation {
+    __u32   batch_events;
+    __u32   max_latency_us;
+};
+
+/*
+ * Write lane of a file, for PLUG162_IOC_SET_PRIORITY. Urgent writes take
+ * a slot kept for them and are cut to one packet. They go out ahead of
+ * the normal writes in flight, which are stopped and then sent on from
+ * where they stopped. With PLUG162_PRIO_CANCEL, normal writes that had
+ * not started are dropped instead; they count as written, and in the
+ * writes_cancelled sysfs attribute, but never reach the plug.
+ */
+#define PLUG162_PRIO_URGENT     0x01
+#define PLUG162_PRIO_CANCEL     0x02    /* only with PLUG162_PRIO_URGENT */
+
+#define PLUG162_IOC_MAGIC   0xb2
+
+#define PLUG162_IOC_GET_CAPS        _IOR(PLUG162_IOC_MAGIC, 0x01, struct plug162_caps)
+/*
+ * Button channels, as a bit mask, whose events this file reads. A channel
+ * has one queue per device, so files reading the same channel compete:
+ * each event goes to one reader only.
+ */
+#define PLUG162_IOC_SET_CHANNELS    _IOW(PLUG162_IOC_MAGIC, 0x02, __u32)
+#define PLUG162_IOC_SET_GESTURE     _IOW(PLUG162_IOC_MAGIC, 0x03, struct plug162_gesture)
+#define PLUG162_IOC_SET_MODERATION  _IOW(PLUG162_IOC_MAGIC, 0x04, struct plug162_moderation)
+#define PLUG162_IOC_GET_MODERATION  _IOR(PLUG162_IOC_MAGIC, 0x05, struct plug162_moderation)
+#define PLUG162_IOC_SET_PRIORITY    _IOW(PLUG162_IOC_MAGIC, 0x06, __u32)
+#define PLUG162_IOC_GET_PRIORITY    _IOR(PLUG162_IOC_MAGIC, 0x07, __u32)
+
+#endif
@@ -0,0 +1,89 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM plug162
+
+#ifndef _PLUG162_TRACE_DEFS_
+#define _PLUG162_TRACE_DEFS_
+
+enum plug162_recover_action {
+    PLUG162_RECOVER_STALL,
+    PLUG162_RECOVER_CLEAR_HALT,
+    PLUG162_RECOVER_RESUBMIT,
+    PLUG162_RECOVER_RESET,
+    PLUG162_RECOVER_GIVE_UP,
+};
+
+enum plug162_ready_stage {
+    PLUG162_READY_PROBED,
+    PLUG162_READY_FIRST_URB,
+};
+
+#endif
+
+#if !defined(_PLUG162_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _PLUG162_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(plug162_recovery,
+    TP_PROTO(int minor, int action, int status, unsigned int attempt),
+
+    TP_ARGS(minor, action, status, attempt),
+
+    TP_STRUCT__entry(
+        __field(int,            minor)
+        __field(int,            action)
+        __field(int,            status)
+        __field(unsigned int,   attempt)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->action = action;
+        __entry->status = status;
+        __entry->attempt = attempt;
+    ),
+
+    TP_printk("plug162%d %s status=%d attempt=%u",
+        __entry->minor,
+        __print_symbolic(__entry->action,
+            { PLUG162_RECOVER_STALL,      "stall" },
+            { PLUG162_RECOVER_CLEAR_HALT, "clear_halt" },
+            { PLUG162_RECOVER_RESUBMIT,   "resubmit" },
+            { PLUG162_RECOVER_RESET,      "reset" },
+            { PLUG162_RECOVER_GIVE_UP,    "give_up" }),
+        __entry->status, __entry->attempt)
+);
+
+/* time since probe started, in us */
+TRACE_EVENT(plug162_ready,
+    TP_PROTO(int minor, int stage, s64 us),
+
+    TP_ARGS(minor, stage, us),
+
+    TP_STRUCT__entry(
+        __field(int,            minor)
+        __field(int,            stage)
+        __field(s64,            us)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->stage = stage;
+        __entry->us = us;
+    ),
+
+    TP_printk("plug162%d %s after %lld us",
+        __entry->minor,
+        __print_symbolic(__entry->stage,
+            { PLUG162_READY_PROBED,    "probed" },
+            { PLUG162_READY_FIRST_URB, "first_urb" }),
+        __entry->us)
+);
+
+#endif /* _PLUG162_TRACE_H_ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE plug162_trace
+#include <trace/define_trace.h>
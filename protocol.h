@@ -1,5 +1,54 @@
+#ifndef _PLUG162_PROTOCOL_
+#define _PLUG162_PROTOCOL_
+
+/*
+ * OUT packets: [opcode, channel, ...]. A packet without a channel byte
+ * addresses channel 0, as sent by hosts that predate channels.
+ */
 #define LED_OFF   0x01
 #define LED_ON    0x02
+#define LED_SET   0x03  /* [LED_SET, channel mask, channel values] */
+/*
+ * [GESTURE_CONFIG, debounce, long press, double press gap], each a
+ * little endian 16 bit ms value. A zero time disables that gesture.
+ */
+#define GESTURE_CONFIG 0x04
+/* [PING, cookie], answered at once with a PONG event */
+#define PING        0x05
+
+/*
+ * IN packets: up to IN packet size / EVENT_SIZE events of
+ * [type, channel, arg low, arg high]. A lone type byte is channel 0.
+ */
+#define EVENT_SIZE  4
+
+#define BUTTON_DOWN         0x01    /* pressed */
+#define BUTTON_RELEASE      0x02    /* arg: hold duration in ms */
+#define BUTTON_LONG_PRESS   0x03    /* still held, arg: hold duration in ms */
+#define BUTTON_DOUBLE_PRESS 0x04    /* after BUTTON_DOWN, arg: ms since release */
+#define PONG                0x10    /* channel: the PING cookie, arg: USB frame */
+
+#define MAX_CHANNELS 8  /* channel masks are one byte */
+
+/*
+ * Vendor control requests, device-to-host, addressed to the interface.
+ *
+ * GET_CAPS returns the capability descriptor:
+ *   [bLength, bVersion, bNumLeds, bNumButtons, wReadyMs]
+ * where wReadyMs (version 2, little endian) is the time from firmware
+ * start to the first SET_CONFIGURATION.
+ * GET_STATUS returns [led channel bits, button channel bits].
+ * GET_TELEMETRY returns the device's counters, all little endian:
+ *   [bLength, bVersion, wWorkMaxUs, dLoops, dSofs, wInAborted,
+ *    wUnknownOps, wButtonEdges, wEventsDropped]
+ * Passing wValue TELEMETRY_CLEAR_MAX restarts the wWorkMaxUs peak.
+ */
+#define REQ_GET_CAPS    0x01
+#define REQ_GET_STATUS  0x02
+#define REQ_GET_TELEMETRY 0x03
 
-#define BUTTON_DOWN 0x01
+#define CAPS_VERSION    2
+#define TELEMETRY_VERSION   1
+#define TELEMETRY_CLEAR_MAX 0x0001
 
+#endif
@@ -0,0 +1,79 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "latency.h"
+
+static int lat_reserve(struct latency *l, size_t n)
+{
+    uint64_t *ns;
+    size_t cap;
+
+    if (l->n + n <= l->cap)
+        return 0;
+
+    cap = l->cap ? l->cap : 1024;
+    while (cap < l->n + n)
+        cap *= 2;
+    ns = realloc(l->ns, cap * sizeof(*ns));
+    if (!ns)
+        return -ENOMEM;
+    l->ns = ns;
+    l->cap = cap;
+
+    return 0;
+}
+
+int lat_add(struct latency *l, uint64_t ns)
+{
+    if (lat_reserve(l, 1))
+        return -ENOMEM;
+    l->ns[l->n++] = ns;
+
+    return 0;
+}
+
+int lat_merge(struct latency *to, const struct latency *from)
+{
+    if (lat_reserve(to, from->n))
+        return -ENOMEM;
+    memcpy(to->ns + to->n, from->ns, from->n * sizeof(*from->ns));
+    to->n += from->n;
+
+    return 0;
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static double lat_pct(const struct latency *l, unsigned int pct)
+{
+    size_t i = (l->n - 1) * pct / 100;
+
+    return l->ns[i] / 1000.0;
+}
+
+void lat_print(const char *name, struct latency *l)
+{
+    if (!l->n) {
+        printf("%-12s      0\n", name);
+        return;
+    }
+
+    qsort(l->ns, l->n, sizeof(*l->ns), lat_cmp);
+    printf("%-12s %6zu  min %9.1f  p50 %9.1f  p90 %9.1f  p99 %9.1f  "
+           "max %9.1f us\n", name, l->n, lat_pct(l, 0), lat_pct(l, 50),
+           lat_pct(l, 90), lat_pct(l, 99), lat_pct(l, 100));
+}
+
+void lat_free(struct latency *l)
+{
+    free(l->ns);
+    memset(l, 0, sizeof(*l));
+}
@@ -0,0 +1,30 @@
+#ifndef _PLUG162_LATENCY_
+#define _PLUG162_LATENCY_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* latency samples of one kind, from one thread */
+struct latency {
+    uint64_t    *ns;
+    size_t      n;
+    size_t      cap;
+};
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int lat_add(struct latency *l, uint64_t ns);
+/* appends @from to @to, for totals over several threads */
+int lat_merge(struct latency *to, const struct latency *from);
+/* "name: n min p50 p90 p99 max" in us; sorts the samples */
+void lat_print(const char *name, struct latency *l);
+void lat_free(struct latency *l);
+
+#endif
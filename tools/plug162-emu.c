@@ -0,0 +1,640 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include "protocol.h"
+#include "plug162-emu.h"
+
+#define EMU_VENDOR_ID       0xdead
+#define EMU_PRODUCT_ID      0xbeef
+#define EMU_EP_SIZE         8
+#define EMU_EP_INTERVAL     10
+#define EMU_EP0_MAX         256
+#define EMU_CLASS_DIR       "/sys/class/plug162"
+
+enum {
+    STR_LANGID,
+    STR_MANUFACTURER,
+    STR_PRODUCT,
+    STR_SERIAL,
+};
+
+/* an IN packet waiting in the pipe */
+struct emu_packet {
+    uint8_t     len;
+    uint8_t     data[EMU_EP_SIZE];
+};
+
+struct emu_ep0_io {
+    struct usb_raw_ep_io    io;
+    unsigned char           data[EMU_EP0_MAX];
+};
+
+struct emu_ep_io {
+    struct usb_raw_ep_io    io;
+    unsigned char           data[EMU_EP_SIZE];
+};
+
+struct plug162_emu {
+    int                 fd;         /* /dev/raw-gadget */
+    struct plug162_emu_config cfg;
+    pthread_t           ep0_thread;
+    pthread_t           in_thread;
+    pthread_t           out_thread;
+    int                 io_started;
+    int                 pipefd[2];  /* struct emu_packet, to in_thread */
+    volatile sig_atomic_t stopping;
+
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    int                 configured;
+
+    struct usb_endpoint_descriptor out_desc;
+    struct usb_endpoint_descriptor in_desc;
+    int                 ep_out;     /* raw-gadget endpoint handles */
+    int                 ep_in;
+
+    /* as kept by the firmware */
+    uint8_t             led_state;
+    uint32_t            loops;
+    uint16_t            unknown_ops;
+    struct timespec     started;
+};
+
+static void emu_wake(int sig)
+{
+    (void)sig;
+}
+
+static uint32_t emu_ms(struct plug162_emu *e)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - e->started.tv_sec) * 1000 +
+           (now.tv_nsec - e->started.tv_nsec) / 1000000;
+}
+
+static void put16(unsigned char *p, uint16_t v)
+{
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    put16(p, v & 0xffff);
+    put16(p + 2, v >> 16);
+}
+
+static int emu_device_desc(unsigned char *buf)
+{
+    struct usb_device_descriptor d = {
+        .bLength            = USB_DT_DEVICE_SIZE,
+        .bDescriptorType    = USB_DT_DEVICE,
+        .bcdUSB             = htole16(0x0200),
+        .bDeviceClass       = USB_CLASS_VENDOR_SPEC,
+        .bDeviceSubClass    = USB_SUBCLASS_VENDOR_SPEC,
+        .bDeviceProtocol    = 0xff,
+        .bMaxPacketSize0    = 64,
+        .idVendor           = htole16(EMU_VENDOR_ID),
+        .idProduct          = htole16(EMU_PRODUCT_ID),
+        .bcdDevice          = htole16(0x0001),
+        .iManufacturer      = STR_MANUFACTURER,
+        .iProduct           = STR_PRODUCT,
+        .iSerialNumber      = STR_SERIAL,
+        .bNumConfigurations = 1,
+    };
+
+    memcpy(buf, &d, sizeof(d));
+    return sizeof(d);
+}
+
+/* the same layout as conf_desc in plug162/descriptors.c */
+static int emu_config_desc(struct plug162_emu *e, unsigned char *buf)
+{
+    struct usb_config_descriptor c = {
+        .bLength            = USB_DT_CONFIG_SIZE,
+        .bDescriptorType    = USB_DT_CONFIG,
+        .bNumInterfaces     = 1,
+        .bConfigurationValue = 1,
+        .bmAttributes       = USB_CONFIG_ATT_ONE,
+        .bMaxPower          = 50,
+    };
+    struct usb_interface_descriptor i = {
+        .bLength            = USB_DT_INTERFACE_SIZE,
+        .bDescriptorType    = USB_DT_INTERFACE,
+        .bNumEndpoints      = 2,
+        .bInterfaceClass    = USB_CLASS_VENDOR_SPEC,
+        .bInterfaceSubClass = USB_SUBCLASS_VENDOR_SPEC,
+        .bInterfaceProtocol = 0xff,
+    };
+    int len = 0;
+
+    memcpy(buf + len, &c, USB_DT_CONFIG_SIZE);
+    len += USB_DT_CONFIG_SIZE;
+    memcpy(buf + len, &i, USB_DT_INTERFACE_SIZE);
+    len += USB_DT_INTERFACE_SIZE;
+    memcpy(buf + len, &e->out_desc, USB_DT_ENDPOINT_SIZE);
+    len += USB_DT_ENDPOINT_SIZE;
+    memcpy(buf + len, &e->in_desc, USB_DT_ENDPOINT_SIZE);
+    len += USB_DT_ENDPOINT_SIZE;
+    put16(buf + 2, len);
+
+    return len;
+}
+
+static int emu_string_desc(struct plug162_emu *e, int index,
+                           unsigned char *buf)
+{
+    const char *s;
+    int len = 2;
+
+    switch (index) {
+    case STR_LANGID:
+        buf[0] = 4;
+        buf[1] = USB_DT_STRING;
+        put16(buf + 2, 0x0409);
+        return 4;
+    case STR_MANUFACTURER:
+        s = "plug162";
+        break;
+    case STR_PRODUCT:
+        s = "plug162 emulator";
+        break;
+    case STR_SERIAL:
+        s = e->cfg.serial;
+        break;
+    default:
+        return -1;
+    }
+
+    for (; *s && len + 2 <= 254; s++, len += 2)
+        put16(buf + len, (unsigned char)*s);
+    buf[0] = len;
+    buf[1] = USB_DT_STRING;
+
+    return len;
+}
+
+static void emu_pick_eps(struct plug162_emu *e)
+{
+    struct usb_raw_eps_info info;
+    int in = 0, out = 0;
+    int n, i;
+
+    memset(&info, 0, sizeof(info));
+    n = ioctl(e->fd, USB_RAW_IOCTL_EPS_INFO, &info);
+    for (i = 0; i < n; i++) {
+        struct usb_raw_ep_info *ep = &info.eps[i];
+
+        if (!ep->caps.type_int)
+            continue;
+        if (!in && ep->caps.dir_in)
+            in = ep->addr == USB_RAW_EP_ADDR_ANY ? 2 : ep->addr;
+        else if (!out && ep->caps.dir_out)
+            out = ep->addr == USB_RAW_EP_ADDR_ANY ? 1 : ep->addr;
+    }
+    if (!in || !out || in == out)
+        fprintf(stderr, "plug162-emu: no interrupt endpoints on the UDC\n");
+
+    e->out_desc.bEndpointAddress = USB_DIR_OUT | out;
+    e->in_desc.bEndpointAddress = USB_DIR_IN | in;
+}
+
+static void emu_handle_out(struct plug162_emu *e, const unsigned char *cmd,
+                           int len)
+{
+    uint8_t channel = (len > 1) ? cmd[1] : 0;
+
+    e->loops++;
+    if (len < 1)
+        return;
+
+    switch (cmd[0]) {
+    case LED_OFF:
+        if (channel < e->cfg.num_leds)
+            e->led_state &= ~(1 << channel);
+        break;
+    case LED_ON:
+        if (channel < e->cfg.num_leds)
+            e->led_state |= 1 << channel;
+        break;
+    case LED_SET:
+        if (len >= 3)
+            e->led_state = (e->led_state & ~cmd[1]) | (cmd[2] & cmd[1]);
+        break;
+    case GESTURE_CONFIG:
+        break;
+    case PING: {
+        unsigned char pong[EVENT_SIZE] = { PONG, channel };
+
+        put16(pong + 2, emu_ms(e) & 0x7ff);
+        plug162_emu_send(e, pong, sizeof(pong));
+        break;
+    }
+    default:
+        if (e->unknown_ops != UINT16_MAX)
+            e->unknown_ops++;
+        break;
+    }
+}
+
+static void *emu_out_thread(void *arg)
+{
+    struct plug162_emu *e = arg;
+    struct emu_ep_io out;
+    int rv;
+
+    while (!e->stopping) {
+        out.io.ep = e->ep_out;
+        out.io.flags = 0;
+        out.io.length = sizeof(out.data);
+        rv = ioctl(e->fd, USB_RAW_IOCTL_EP_READ, &out);
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        emu_handle_out(e, out.data, rv);
+        if (e->cfg.out)
+            e->cfg.out(out.data, rv, e->cfg.user);
+    }
+
+    return NULL;
+}
+
+static void *emu_in_thread(void *arg)
+{
+    struct plug162_emu *e = arg;
+    struct emu_packet pkt;
+    struct emu_ep_io in;
+
+    while (!e->stopping) {
+        if (read(e->pipefd[0], &pkt, sizeof(pkt)) != sizeof(pkt))
+            break;
+        in.io.ep = e->ep_in;
+        in.io.flags = 0;
+        in.io.length = pkt.len;
+        memcpy(in.data, pkt.data, pkt.len);
+        while (ioctl(e->fd, USB_RAW_IOCTL_EP_WRITE, &in) < 0) {
+            if (errno != EINTR || e->stopping)
+                return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+static int emu_configure(struct plug162_emu *e)
+{
+    if (e->configured)
+        return 0;
+
+    e->ep_out = ioctl(e->fd, USB_RAW_IOCTL_EP_ENABLE, &e->out_desc);
+    e->ep_in = ioctl(e->fd, USB_RAW_IOCTL_EP_ENABLE, &e->in_desc);
+    if (e->ep_out < 0 || e->ep_in < 0)
+        return -errno;
+    ioctl(e->fd, USB_RAW_IOCTL_VBUS_DRAW, 50);
+    if (ioctl(e->fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0)
+        return -errno;
+
+    if (!e->io_started) {
+        pthread_create(&e->out_thread, NULL, emu_out_thread, e);
+        pthread_create(&e->in_thread, NULL, emu_in_thread, e);
+        e->io_started = 1;
+    }
+
+    pthread_mutex_lock(&e->lock);
+    e->configured = 1;
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+
+    return 0;
+}
+
+/* returns the length of the IN data in @buf, 0 for none, -1 to stall */
+static int emu_standard(struct plug162_emu *e, struct usb_ctrlrequest *ctrl,
+                        unsigned char *buf)
+{
+    uint16_t value = le16toh(ctrl->wValue);
+
+    switch (ctrl->bRequest) {
+    case USB_REQ_GET_DESCRIPTOR:
+        switch (value >> 8) {
+        case USB_DT_DEVICE:
+            return emu_device_desc(buf);
+        case USB_DT_CONFIG:
+            return emu_config_desc(e, buf);
+        case USB_DT_STRING:
+            return emu_string_desc(e, value & 0xff, buf);
+        }
+        return -1;
+    case USB_REQ_SET_CONFIGURATION:
+        return emu_configure(e) < 0 ? -1 : 0;
+    case USB_REQ_SET_INTERFACE:
+        return 0;
+    case USB_REQ_GET_CONFIGURATION:
+        buf[0] = e->configured;
+        return 1;
+    case USB_REQ_GET_INTERFACE:
+        buf[0] = 0;
+        return 1;
+    case USB_REQ_GET_STATUS:
+        put16(buf, 0);
+        return 2;
+    }
+
+    return -1;
+}
+
+static int emu_vendor(struct plug162_emu *e, struct usb_ctrlrequest *ctrl,
+                      unsigned char *buf)
+{
+    if (ctrl->bRequestType !=
+        (USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_INTERFACE))
+        return -1;
+
+    switch (ctrl->bRequest) {
+    case REQ_GET_CAPS:
+        buf[0] = 6;
+        buf[1] = CAPS_VERSION;
+        buf[2] = e->cfg.num_leds;
+        buf[3] = e->cfg.num_buttons;
+        put16(buf + 4, 1);
+        return 6;
+    case REQ_GET_STATUS:
+        buf[0] = e->led_state;
+        buf[1] = 0;
+        return 2;
+    case REQ_GET_TELEMETRY:
+        memset(buf, 0, 20);
+        buf[0] = 20;
+        buf[1] = TELEMETRY_VERSION;
+        put32(buf + 4, e->loops);
+        put32(buf + 8, emu_ms(e));
+        put16(buf + 14, e->unknown_ops);
+        return 20;
+    }
+
+    return -1;
+}
+
+static void emu_control(struct plug162_emu *e, struct usb_ctrlrequest *ctrl)
+{
+    struct emu_ep0_io resp;
+    uint16_t length = le16toh(ctrl->wLength);
+    int len;
+
+    memset(&resp, 0, sizeof(resp));
+    if ((ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD)
+        len = emu_standard(e, ctrl, resp.data);
+    else
+        len = emu_vendor(e, ctrl, resp.data);
+
+    if (len < 0) {
+        ioctl(e->fd, USB_RAW_IOCTL_EP0_STALL, 0);
+        return;
+    }
+
+    if (ctrl->bRequestType & USB_DIR_IN) {
+        resp.io.length = len < length ? len : length;
+        ioctl(e->fd, USB_RAW_IOCTL_EP0_WRITE, &resp);
+    } else {
+        resp.io.length = length < EMU_EP0_MAX ? length : EMU_EP0_MAX;
+        ioctl(e->fd, USB_RAW_IOCTL_EP0_READ, &resp);
+    }
+}
+
+static void *emu_ep0_thread(void *arg)
+{
+    struct plug162_emu *e = arg;
+    struct {
+        struct usb_raw_event    ev;
+        unsigned char           data[EMU_EP0_MAX];
+    } event;
+
+    while (!e->stopping) {
+        event.ev.type = USB_RAW_EVENT_INVALID;
+        event.ev.length = sizeof(event.data);
+        if (ioctl(e->fd, USB_RAW_IOCTL_EVENT_FETCH, &event) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        switch (event.ev.type) {
+        case USB_RAW_EVENT_CONNECT:
+            emu_pick_eps(e);
+            break;
+        case USB_RAW_EVENT_CONTROL:
+            emu_control(e, (struct usb_ctrlrequest *)event.ev.data);
+            break;
+        default:
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+struct plug162_emu *plug162_emu_start(const struct plug162_emu_config *cfg)
+{
+    struct sigaction sa = { .sa_handler = emu_wake };
+    struct usb_raw_init init;
+    struct plug162_emu *e;
+
+    e = calloc(1, sizeof(*e));
+    if (!e)
+        return NULL;
+    e->cfg = *cfg;
+    if (!e->cfg.udc_driver)
+        e->cfg.udc_driver = "dummy_udc";
+    if (!e->cfg.udc_device)
+        e->cfg.udc_device = "dummy_udc.0";
+    if (!e->cfg.serial)
+        e->cfg.serial = "EMU0001";
+    if (!e->cfg.num_leds)
+        e->cfg.num_leds = 1;
+    if (!e->cfg.num_buttons)
+        e->cfg.num_buttons = 1;
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->cond, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &e->started);
+
+    e->out_desc.bLength = USB_DT_ENDPOINT_SIZE;
+    e->out_desc.bDescriptorType = USB_DT_ENDPOINT;
+    e->out_desc.bmAttributes = USB_ENDPOINT_XFER_INT;
+    e->out_desc.wMaxPacketSize = htole16(EMU_EP_SIZE);
+    e->out_desc.bInterval = EMU_EP_INTERVAL;
+    e->in_desc = e->out_desc;
+
+    /* no SA_RESTART: plug162_emu_stop() interrupts blocking ioctls */
+    sigaction(SIGUSR2, &sa, NULL);
+
+    if (pipe2(e->pipefd, O_CLOEXEC))
+        goto error_free;
+    /* a host that stopped polling must not block the senders */
+    fcntl(e->pipefd[1], F_SETFL, O_NONBLOCK);
+
+    e->fd = open("/dev/raw-gadget", O_RDWR | O_CLOEXEC);
+    if (e->fd < 0)
+        goto error_pipe;
+
+    memset(&init, 0, sizeof(init));
+    snprintf((char *)init.driver_name, sizeof(init.driver_name), "%s",
+             e->cfg.udc_driver);
+    snprintf((char *)init.device_name, sizeof(init.device_name), "%s",
+             e->cfg.udc_device);
+    init.speed = USB_SPEED_FULL;    /* as the AT90USB162 */
+    if (ioctl(e->fd, USB_RAW_IOCTL_INIT, &init) < 0 ||
+        ioctl(e->fd, USB_RAW_IOCTL_RUN, 0) < 0)
+        goto error_fd;
+
+    if (pthread_create(&e->ep0_thread, NULL, emu_ep0_thread, e))
+        goto error_fd;
+
+    return e;
+
+error_fd:
+    close(e->fd);
+error_pipe:
+    close(e->pipefd[0]);
+    close(e->pipefd[1]);
+error_free:
+    free(e);
+    return NULL;
+}
+
+int plug162_emu_wait_configured(struct plug162_emu *e, int timeout_ms)
+{
+    struct timespec until;
+    int rv = 0;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&e->lock);
+    while (!e->configured && rv == 0)
+        rv = pthread_cond_timedwait(&e->cond, &e->lock, &until);
+    pthread_mutex_unlock(&e->lock);
+
+    return e->configured ? 0 : -ETIMEDOUT;
+}
+
+int plug162_emu_send(struct plug162_emu *e, const void *data, size_t len)
+{
+    struct emu_packet pkt;
+
+    if (len > sizeof(pkt.data))
+        return -EINVAL;
+
+    memset(&pkt, 0, sizeof(pkt));
+    pkt.len = len;
+    memcpy(pkt.data, data, len);
+    if (write(e->pipefd[1], &pkt, sizeof(pkt)) != sizeof(pkt))
+        return -errno;
+
+    return 0;
+}
+
+int plug162_emu_find_node(const char *serial, char *node, size_t size,
+                          int timeout_ms)
+{
+    struct timespec now, until;
+    struct dirent *de;
+    char path[512], buf[128];
+    DIR *dir;
+    FILE *f;
+
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+
+    do {
+        dir = opendir(EMU_CLASS_DIR);
+        while (dir && (de = readdir(dir))) {
+            if (de->d_name[0] == '.')
+                continue;
+            snprintf(path, sizeof(path), EMU_CLASS_DIR "/%s/serial",
+                     de->d_name);
+            f = fopen(path, "r");
+            if (!f)
+                continue;
+            if (fgets(buf, sizeof(buf), f)) {
+                buf[strcspn(buf, "\n")] = '\0';
+                if (!strcmp(buf, serial)) {
+                    snprintf(node, size, "/dev/%s", de->d_name);
+                    fclose(f);
+                    closedir(dir);
+                    return 0;
+                }
+            }
+            fclose(f);
+        }
+        if (dir)
+            closedir(dir);
+        usleep(10000);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec < until.tv_sec ||
+             (now.tv_sec == until.tv_sec && now.tv_nsec < until.tv_nsec));
+
+    return -ETIMEDOUT;
+}
+
+/* a thread may block in an ioctl just after being signalled; keep at it */
+static void emu_join(pthread_t t)
+{
+    struct timespec until;
+
+    for (;;) {
+        pthread_kill(t, SIGUSR2);
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += 10000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        if (pthread_timedjoin_np(t, NULL, &until) != ETIMEDOUT)
+            return;
+    }
+}
+
+void plug162_emu_stop(struct plug162_emu *e)
+{
+    if (!e)
+        return;
+
+    /* the OUT thread answers PINGs through the pipe, so it goes first */
+    e->stopping = 1;
+    emu_join(e->ep0_thread);
+    if (e->io_started) {
+        emu_join(e->out_thread);
+        emu_join(e->in_thread);
+    }
+
+    close(e->fd);
+    close(e->pipefd[0]);
+    close(e->pipefd[1]);
+    pthread_cond_destroy(&e->cond);
+    pthread_mutex_destroy(&e->lock);
+    free(e);
+}
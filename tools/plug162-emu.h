@@ -0,0 +1,38 @@
+#ifndef _PLUG162_EMU_
+#define _PLUG162_EMU_
+
+#include <stddef.h>
+
+/*
+ * A plug162 in software, through raw-gadget: with the raw_gadget and
+ * dummy_hcd modules loaded, it enumerates on the local host and the
+ * driver binds to it like to a real plug. It answers the vendor requests
+ * in protocol.h and keeps LED state as the firmware does.
+ */
+struct plug162_emu;
+
+struct plug162_emu_config {
+    const char      *udc_driver;    /* default "dummy_udc" */
+    const char      *udc_device;    /* default "dummy_udc.0" */
+    const char      *serial;
+    unsigned int    num_leds;
+    unsigned int    num_buttons;
+    /* every OUT packet, from the emulator's own thread */
+    void            (*out)(const unsigned char *data, size_t len, void *user);
+    void            *user;
+};
+
+struct plug162_emu *plug162_emu_start(const struct plug162_emu_config *cfg);
+/* 0 once the host has configured the device, -ETIMEDOUT otherwise */
+int plug162_emu_wait_configured(struct plug162_emu *e, int timeout_ms);
+/*
+ * Queues one IN packet of at most 8 bytes, sent when the host polls.
+ * -EAGAIN once the host has left enough of them unread.
+ */
+int plug162_emu_send(struct plug162_emu *e, const void *data, size_t len);
+/* the /dev node the driver gave the plug with @serial */
+int plug162_emu_find_node(const char *serial, char *node, size_t size,
+                          int timeout_ms);
+void plug162_emu_stop(struct plug162_emu *e);
+
+#endif
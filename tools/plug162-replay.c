@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+#include "plug162_ioctl.h"
+#include "plug162_capture.h"
+#include "latency.h"
+#include "plug162-emu.h"
+
+#define NODE_WAIT_MS    5000
+#define DRAIN_WAIT_MS   2000
+
+struct record {
+    struct plug162_capture_record   rec;
+    const unsigned char             *data;
+};
+
+struct replay {
+    struct record       *recs;
+    size_t              nrecs;
+    unsigned char       *file;
+    int                 fd;
+    struct plug162_emu  *emu;
+
+    /* injection times of IN events, consumed in order by the reader */
+    pthread_mutex_t     lock;
+    uint64_t            *injected;
+    size_t              ninjected;
+    size_t              nread;
+    volatile int        stop;
+    struct latency      event_lat;
+};
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: plug162-replay [-l] [-s speed] [-d node] [-u udc] [-U dev] capture\n"
+        "  -l        list the records and exit\n"
+        "  -s speed  replay N times as fast, 0 for back to back (default 1)\n"
+        "  -d node   send OUT records to a plug instead of the emulator;\n"
+        "            IN records are then skipped\n"
+        "  -u, -U    raw-gadget UDC driver and device for the emulator\n"
+        "            (default dummy_udc, dummy_udc.0)\n"
+        "A capture is read from /sys/kernel/debug/plug162/plug162N/capture\n"
+        "with the driver loaded with capture_kb set.\n");
+    exit(2);
+}
+
+static int load_capture(struct replay *r, const char *path)
+{
+    struct plug162_capture_header hdr;
+    struct stat st;
+    size_t off, cap = 0;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (!f || fstat(fileno(f), &st)) {
+        perror(path);
+        return -1;
+    }
+    r->file = malloc(st.st_size + 1);
+    if (!r->file || fread(r->file, 1, st.st_size, f) != (size_t)st.st_size) {
+        fprintf(stderr, "%s: short read\n", path);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    if ((size_t)st.st_size < sizeof(hdr))
+        goto bad;
+    memcpy(&hdr, r->file, sizeof(hdr));
+    if (hdr.magic != PLUG162_CAPTURE_MAGIC ||
+        hdr.version != PLUG162_CAPTURE_VERSION ||
+        hdr.record_size != sizeof(struct plug162_capture_record))
+        goto bad;
+
+    for (off = sizeof(hdr); off < (size_t)st.st_size; ) {
+        struct record *rec;
+
+        if (r->nrecs == cap) {
+            cap = cap ? cap * 2 : 1024;
+            rec = realloc(r->recs, cap * sizeof(*rec));
+            if (!rec)
+                return -1;
+            r->recs = rec;
+        }
+        rec = &r->recs[r->nrecs];
+        if (off + sizeof(rec->rec) > (size_t)st.st_size)
+            goto bad;
+        memcpy(&rec->rec, r->file + off, sizeof(rec->rec));
+        off += sizeof(rec->rec);
+        if (off + rec->rec.len > (size_t)st.st_size)
+            goto bad;
+        rec->data = r->file + off;
+        off += rec->rec.len;
+        r->nrecs++;
+    }
+
+    return 0;
+
+bad:
+    fprintf(stderr, "%s: not a plug162 capture, or truncated\n", path);
+    return -1;
+}
+
+/* the events readers get; the driver keeps PONGs to itself */
+static size_t events_in(const struct record *rec)
+{
+    size_t i, n = 0;
+
+    if (rec->rec.len < EVENT_SIZE)
+        return rec->rec.len && rec->data[0] != PONG;
+
+    for (i = 0; i + EVENT_SIZE <= rec->rec.len; i += EVENT_SIZE)
+        n += rec->data[i] != PONG;
+
+    return n;
+}
+
+static void list_capture(const struct replay *r)
+{
+    uint64_t first = r->nrecs ? r->recs[0].rec.ts_ns : 0;
+    size_t i, j;
+
+    for (i = 0; i < r->nrecs; i++) {
+        const struct record *rec = &r->recs[i];
+
+        if (rec->rec.dropped)
+            printf("            ... %u records lost\n", rec->rec.dropped);
+        printf("%12.6f %s %5u ", (rec->rec.ts_ns - first) / 1e9,
+               rec->rec.dir == PLUG162_CAPTURE_IN ? "IN " : "OUT",
+               rec->rec.len);
+        for (j = 0; j < rec->rec.len && j < 16; j++)
+            printf(" %02x", rec->data[j]);
+        printf("%s\n", rec->rec.len > 16 ? " ..." : "");
+    }
+}
+
+static void *reader(void *arg)
+{
+    struct replay *r = arg;
+    struct plug162_event ev[16];
+    struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+    uint64_t now;
+    ssize_t n;
+    size_t i;
+
+    while (!r->stop) {
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        n = read(r->fd, ev, sizeof(ev));
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            break;
+        }
+        now = now_ns();
+
+        pthread_mutex_lock(&r->lock);
+        for (i = 0; i < n / sizeof(ev[0]); i++) {
+            if (r->nread < r->ninjected)
+                lat_add(&r->event_lat, now - r->injected[r->nread]);
+            r->nread++;
+        }
+        pthread_mutex_unlock(&r->lock);
+    }
+
+    return NULL;
+}
+
+static void sleep_until(uint64_t ns)
+{
+    struct timespec ts = {
+        .tv_sec = ns / 1000000000ull,
+        .tv_nsec = ns % 1000000000ull,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int replay(struct replay *r, double speed)
+{
+    struct latency write_lat = { 0 }, late = { 0 };
+    uint64_t first = r->recs[0].rec.ts_ns;
+    uint64_t span = r->recs[r->nrecs - 1].rec.ts_ns - first;
+    uint64_t t0, due, start, took, synced;
+    size_t i, k, skipped = 0, failed = 0, lost = 0, events = 0;
+    pthread_t thread;
+    int rv;
+
+    for (i = 0; i < r->nrecs; i++) {
+        lost += r->recs[i].rec.dropped;
+        if (r->recs[i].rec.dir == PLUG162_CAPTURE_IN)
+            events += events_in(&r->recs[i]);
+    }
+    r->injected = calloc(events + 1, sizeof(*r->injected));
+    if (!r->injected)
+        return -1;
+
+    pthread_create(&thread, NULL, reader, r);
+
+    t0 = now_ns();
+    for (i = 0; i < r->nrecs; i++) {
+        const struct record *rec = &r->recs[i];
+
+        if (speed > 0) {
+            due = t0 + (uint64_t)((rec->rec.ts_ns - first) / speed);
+            sleep_until(due);
+            lat_add(&late, now_ns() - due);
+        }
+
+        if (rec->rec.dir == PLUG162_CAPTURE_OUT) {
+            start = now_ns();
+            if (write(r->fd, rec->data, rec->rec.len) < 0)
+                failed++;
+            lat_add(&write_lat, now_ns() - start);
+        } else if (r->emu) {
+            pthread_mutex_lock(&r->lock);
+            start = now_ns();
+            for (k = 0; k < events_in(rec); k++)
+                r->injected[r->ninjected++] = start;
+            pthread_mutex_unlock(&r->lock);
+            while ((rv = plug162_emu_send(r->emu, rec->data,
+                                          rec->rec.len)) == -EAGAIN)
+                usleep(100);
+            if (rv)
+                failed++;
+        } else {
+            skipped++;
+        }
+    }
+    start = now_ns();
+    fsync(r->fd);
+    synced = now_ns() - start;
+    took = now_ns() - t0;
+
+    /* let the last events come in */
+    due = now_ns() + DRAIN_WAIT_MS * 1000000ull;
+    while (now_ns() < due) {
+        pthread_mutex_lock(&r->lock);
+        k = r->nread >= r->ninjected;
+        pthread_mutex_unlock(&r->lock);
+        if (k)
+            break;
+        usleep(1000);
+    }
+    r->stop = 1;
+    pthread_join(thread, NULL);
+
+    printf("%zu records in %.3f s (captured over %.3f s, speed %g)\n",
+           r->nrecs, took / 1e9, span / 1e9, speed);
+    if (lost)
+        printf("%zu records were lost when capturing\n", lost);
+    if (skipped)
+        printf("%zu IN records skipped, no emulator\n", skipped);
+    if (failed)
+        printf("%zu records failed\n", failed);
+    printf("%zu of %zu events read back\n", r->nread, r->ninjected);
+    lat_print("write", &write_lat);
+    printf("%-12s %.1f us\n", "fsync", synced / 1e3);
+    lat_print("event", &r->event_lat);
+    if (speed > 0)
+        lat_print("lateness", &late);
+
+    lat_free(&write_lat);
+    lat_free(&late);
+
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct plug162_emu_config cfg = { .num_leds = MAX_CHANNELS,
+                                      .num_buttons = MAX_CHANNELS };
+    struct replay r = { .fd = -1 };
+    const char *node_arg = NULL;
+    char serial[64], node[300];
+    double speed = 1;
+    int list = 0;
+    int opt, rv;
+
+    while ((opt = getopt(argc, argv, "ls:d:u:U:")) != -1) {
+        switch (opt) {
+        case 'l':
+            list = 1;
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        case 'd':
+            node_arg = optarg;
+            break;
+        case 'u':
+            cfg.udc_driver = optarg;
+            break;
+        case 'U':
+            cfg.udc_device = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1 || speed < 0)
+        usage();
+
+    if (load_capture(&r, argv[optind]))
+        return 1;
+    if (list) {
+        list_capture(&r);
+        return 0;
+    }
+    if (!r.nrecs) {
+        fprintf(stderr, "empty capture\n");
+        return 1;
+    }
+    pthread_mutex_init(&r.lock, NULL);
+
+    if (!node_arg) {
+        snprintf(serial, sizeof(serial), "replay-%d", getpid());
+        cfg.serial = serial;
+        r.emu = plug162_emu_start(&cfg);
+        if (!r.emu || plug162_emu_wait_configured(r.emu, NODE_WAIT_MS) ||
+            plug162_emu_find_node(serial, node, sizeof(node),
+                                  NODE_WAIT_MS)) {
+            fprintf(stderr, "the emulated plug did not show up; are "
+                    "raw_gadget, dummy_hcd and the driver loaded?\n");
+            plug162_emu_stop(r.emu);
+            return 1;
+        }
+        node_arg = node;
+    }
+
+    r.fd = open(node_arg, O_RDWR | O_CLOEXEC);
+    if (r.fd < 0) {
+        perror(node_arg);
+        plug162_emu_stop(r.emu);
+        return 1;
+    }
+
+    rv = replay(&r, speed);
+
+    close(r.fd);
+    plug162_emu_stop(r.emu);
+    lat_free(&r.event_lat);
+    free(r.injected);
+    free(r.recs);
+    free(r.file);
+
+    return rv;
+}
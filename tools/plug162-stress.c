@@ -0,0 +1,812 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+
+#include "protocol.h"
+#include "plug162_ioctl.h"
+#include "latency.h"
+#include "plug162-emu.h"
+
+#define CLASS_DIR       "/sys/class/plug162"
+#define DRIVER_DIR      "/sys/bus/usb/drivers/usb-plug162"
+#define WRITE_URBS      "/sys/kernel/debug/plug162/write_urbs"
+#define LOCK_STAT       "/proc/lock_stat"
+#define NODE_WAIT_MS    5000
+#define QUIESCE_MS      2000
+#define JOIN_WAIT_S     10
+#define BIG_WRITE       8192    /* sent from pinned pages */
+
+enum op {
+    OP_OPEN,
+    OP_CLOSE,
+    OP_READ,
+    OP_WRITE,
+    OP_BIG_WRITE,
+    OP_IOCTL,
+    OP_FSYNC,
+    NR_OPS,
+};
+
+static const char *const op_names[NR_OPS] = {
+    [OP_OPEN]       = "open",
+    [OP_CLOSE]      = "close",
+    [OP_READ]       = "read",
+    [OP_WRITE]      = "write",
+    [OP_BIG_WRITE]  = "big write",
+    [OP_IOCTL]      = "ioctl",
+    [OP_FSYNC]      = "fsync",
+};
+
+enum fault {
+    FAULT_UNPLUG,       /* the emulator disconnects and comes back */
+    FAULT_UNBIND,       /* the driver is unbound and bound again */
+    FAULT_RESET,        /* USBDEVFS_RESET, through pre_reset/post_reset */
+    FAULT_SUSPEND,      /* autosuspend allowed for a while */
+    NR_FAULTS,
+};
+
+static const char *const fault_names[NR_FAULTS] = {
+    [FAULT_UNPLUG]  = "unplug",
+    [FAULT_UNBIND]  = "unbind",
+    [FAULT_RESET]   = "reset",
+    [FAULT_SUSPEND] = "suspend",
+};
+
+/* lock classes of the driver, as lockdep names them */
+static const char *const lock_names[] = {
+    "&dev->io_mutex",
+    "&dev->read_mutex",
+    "&dev->files_lock",
+    "&dev->rtt_lock",
+    "&dev->capture_lock",
+    "plug162_idr_lock",
+    "plug162_srcu",
+};
+
+/* kernel log lines that fail the run */
+static const char *const splats[] = {
+    "possible circular locking",
+    "possible recursive locking",
+    "inconsistent lock state",
+    "suspicious RCU usage",
+    "WARNING:",
+    "BUG:",
+    "INFO: task",
+    "Oops",
+};
+
+struct stress;
+
+struct worker {
+    struct stress       *s;
+    pthread_t           thread;
+    unsigned int        seed;
+    int                 fd;
+    unsigned char       *big;
+    struct latency      lat[NR_OPS];
+    unsigned long       errors[NR_OPS];
+};
+
+struct stress {
+    struct plug162_emu_config cfg;
+    char                serial[64];
+    int                 faults;     /* mask of enum fault */
+    int                 fault_ms;
+    int                 event_rate; /* per second */
+    volatile int        stop;
+
+    /* the emulator is replaced on FAULT_UNPLUG */
+    pthread_rwlock_t    emu_lock;
+    struct plug162_emu  *emu;
+
+    pthread_mutex_t     node_lock;
+    char                node[300];
+
+    unsigned long       faulted[NR_FAULTS];
+    unsigned long       fault_failed[NR_FAULTS];
+    unsigned long       injected;
+    unsigned long       read_events;
+};
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "usage: plug162-stress [-t threads] [-d seconds] [-f ms] [-F faults]\n"
+        "                      [-e rate] [-u udc] [-U dev]\n"
+        "  -t threads  workers opening, reading, writing and closing (8)\n"
+        "  -d seconds  length of the run (10)\n"
+        "  -f ms       time between faults, 0 for none (200)\n"
+        "  -F faults   comma separated, from unplug,unbind,reset,suspend\n"
+        "              (all)\n"
+        "  -e rate     button events injected per second (1000)\n"
+        "  -u, -U      raw-gadget UDC driver and device for the emulator\n"
+        "              (default dummy_udc, dummy_udc.0)\n"
+        "Run as root, against a kernel with lockdep and lock_stat for the\n"
+        "lock report. Fails on kernel splats or write urbs left behind.\n");
+    exit(2);
+}
+
+static int parse_faults(const char *arg)
+{
+    char *list = strdup(arg), *save, *tok;
+    int mask = 0;
+    int i;
+
+    for (tok = strtok_r(list, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        for (i = 0; i < NR_FAULTS; i++)
+            if (!strcmp(tok, fault_names[i]))
+                break;
+        if (i == NR_FAULTS) {
+            fprintf(stderr, "unknown fault %s\n", tok);
+            usage();
+        }
+        mask |= 1 << i;
+    }
+    free(list);
+
+    return mask;
+}
+
+static int write_file(const char *path, const char *val)
+{
+    int fd, rv = 0;
+
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    if (write(fd, val, strlen(val)) < 0)
+        rv = -errno;
+    close(fd);
+
+    return rv;
+}
+
+static long read_long(const char *path)
+{
+    char buf[32];
+    long val = -1;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (fgets(buf, sizeof(buf), f))
+        val = strtol(buf, NULL, 10);
+    fclose(f);
+
+    return val;
+}
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+}
+
+/*
+ * The interface and the usb device the node hangs off, as sysfs
+ * directories; @intf gets the interface's name for bind and unbind.
+ */
+static int node_sysfs(struct stress *s, char *udev, size_t size,
+                      char *intf, size_t intf_size)
+{
+    char link[512], path[PATH_MAX];
+
+    pthread_mutex_lock(&s->node_lock);
+    snprintf(link, sizeof(link), CLASS_DIR "/%s/device",
+             basename(s->node));
+    pthread_mutex_unlock(&s->node_lock);
+
+    if (!realpath(link, path))
+        return -errno;
+    snprintf(intf, intf_size, "%s", basename(path));
+    snprintf(udev, size, "%s", dirname(path));
+
+    return 0;
+}
+
+static int refresh_node(struct stress *s)
+{
+    char node[sizeof(s->node)];
+    int rv;
+
+    rv = plug162_emu_find_node(s->serial, node, sizeof(node), NODE_WAIT_MS);
+    if (rv)
+        return rv;
+    pthread_mutex_lock(&s->node_lock);
+    memcpy(s->node, node, sizeof(node));
+    pthread_mutex_unlock(&s->node_lock);
+
+    return 0;
+}
+
+static int start_emu(struct stress *s)
+{
+    s->emu = plug162_emu_start(&s->cfg);
+    if (!s->emu || plug162_emu_wait_configured(s->emu, NODE_WAIT_MS)) {
+        plug162_emu_stop(s->emu);
+        s->emu = NULL;
+        return -ENODEV;
+    }
+
+    return refresh_node(s);
+}
+
+static int fault_unplug(struct stress *s)
+{
+    int rv;
+
+    pthread_rwlock_wrlock(&s->emu_lock);
+    plug162_emu_stop(s->emu);
+    sleep_ms(s->fault_ms / 4);
+    rv = start_emu(s);
+    pthread_rwlock_unlock(&s->emu_lock);
+
+    return rv;
+}
+
+static int fault_unbind(struct stress *s)
+{
+    char udev[PATH_MAX], intf[64];
+    int rv;
+
+    rv = node_sysfs(s, udev, sizeof(udev), intf, sizeof(intf));
+    if (rv)
+        return rv;
+    rv = write_file(DRIVER_DIR "/unbind", intf);
+    if (rv)
+        return rv;
+    sleep_ms(s->fault_ms / 4);
+    rv = write_file(DRIVER_DIR "/bind", intf);
+    if (rv)
+        return rv;
+
+    return refresh_node(s);
+}
+
+static int fault_reset(struct stress *s)
+{
+    char udev[PATH_MAX], intf[64], path[PATH_MAX + 16];
+    long bus, devnum;
+    int fd, rv = 0;
+
+    rv = node_sysfs(s, udev, sizeof(udev), intf, sizeof(intf));
+    if (rv)
+        return rv;
+    snprintf(path, sizeof(path), "%s/busnum", udev);
+    bus = read_long(path);
+    snprintf(path, sizeof(path), "%s/devnum", udev);
+    devnum = read_long(path);
+    if (bus < 0 || devnum < 0)
+        return -ENODEV;
+
+    snprintf(path, sizeof(path), "/dev/bus/usb/%03ld/%03ld", bus, devnum);
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    if (ioctl(fd, USBDEVFS_RESET, 0) < 0)
+        rv = -errno;
+    close(fd);
+
+    return rv;
+}
+
+static int fault_suspend(struct stress *s)
+{
+    char udev[PATH_MAX], intf[64], path[PATH_MAX + 32];
+    int rv;
+
+    rv = node_sysfs(s, udev, sizeof(udev), intf, sizeof(intf));
+    if (rv)
+        return rv;
+    snprintf(path, sizeof(path), "%s/power/autosuspend_delay_ms", udev);
+    write_file(path, "0");
+    snprintf(path, sizeof(path), "%s/power/control", udev);
+    rv = write_file(path, "auto");
+    if (rv)
+        return rv;
+    sleep_ms(s->fault_ms / 2);
+
+    return write_file(path, "on");
+}
+
+static void *faulter(void *arg)
+{
+    struct stress *s = arg;
+    unsigned int seed = getpid();
+    enum fault f;
+    int rv;
+
+    while (!s->stop) {
+        sleep_ms(s->fault_ms);
+        if (s->stop)
+            break;
+
+        do
+            f = rand_r(&seed) % NR_FAULTS;
+        while (!(s->faults & (1 << f)));
+
+        switch (f) {
+        case FAULT_UNPLUG:
+            rv = fault_unplug(s);
+            break;
+        case FAULT_UNBIND:
+            rv = fault_unbind(s);
+            break;
+        case FAULT_RESET:
+            rv = fault_reset(s);
+            break;
+        default:
+            rv = fault_suspend(s);
+            break;
+        }
+
+        s->faulted[f]++;
+        if (rv) {
+            if (!s->fault_failed[f]++)
+                fprintf(stderr, "%s: %s\n", fault_names[f], strerror(-rv));
+            /* without the permission it would only fail again */
+            if (rv == -EACCES || rv == -EPERM)
+                s->faults &= ~(1 << f);
+            if (!s->faults)
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+static void *injector(void *arg)
+{
+    struct stress *s = arg;
+    unsigned char ev[EVENT_SIZE] = { BUTTON_DOWN };
+    unsigned int seed = getpid() + 1;
+    int period_us = 1000000 / s->event_rate;
+
+    while (!s->stop) {
+        ev[0] = ev[0] == BUTTON_DOWN ? BUTTON_RELEASE : BUTTON_DOWN;
+        ev[1] = rand_r(&seed) % MAX_CHANNELS;
+        pthread_rwlock_rdlock(&s->emu_lock);
+        if (s->emu && !plug162_emu_send(s->emu, ev, sizeof(ev)))
+            s->injected++;
+        pthread_rwlock_unlock(&s->emu_lock);
+        usleep(period_us);
+    }
+
+    return NULL;
+}
+
+/* errors that mean the device went away or is being reset */
+static int gone(int err)
+{
+    return err == ENODEV || err == ESHUTDOWN || err == EIO ||
+           err == EPIPE || err == EPROTO || err == ENOENT || err == ENXIO;
+}
+
+/* times one op; 0 when it worked or would merely have blocked */
+static int timed(struct worker *w, enum op op, long rv, uint64_t start)
+{
+    int err = rv < 0 ? errno : 0;
+
+    lat_add(&w->lat[op], now_ns() - start);
+    if (!err || err == EAGAIN || err == EINTR || err == ETIMEDOUT)
+        return 0;
+
+    w->errors[op]++;
+    if (gone(err) && w->fd >= 0) {
+        close(w->fd);
+        w->fd = -1;
+    }
+
+    return -err;
+}
+
+static void worker_open(struct worker *w)
+{
+    char node[sizeof(w->s->node)];
+    uint64_t start;
+
+    pthread_mutex_lock(&w->s->node_lock);
+    memcpy(node, w->s->node, sizeof(node));
+    pthread_mutex_unlock(&w->s->node_lock);
+
+    start = now_ns();
+    w->fd = open(node, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (timed(w, OP_OPEN, w->fd, start))
+        sleep_ms(1);
+}
+
+static void worker_read(struct worker *w)
+{
+    struct plug162_event ev[16];
+    struct pollfd pfd = { .fd = w->fd, .events = POLLIN };
+    uint64_t start = now_ns();
+    ssize_t n;
+
+    if (rand_r(&w->seed) & 1)
+        poll(&pfd, 1, 10);
+    n = read(w->fd, ev, sizeof(ev));
+    if (!timed(w, OP_READ, n, start) && n > 0)
+        __atomic_add_fetch(&w->s->read_events, n / sizeof(ev[0]),
+                           __ATOMIC_RELAXED);
+}
+
+static void worker_write(struct worker *w)
+{
+    unsigned char cmd[3] = { LED_SET, 0xff, rand_r(&w->seed) };
+    uint64_t start = now_ns();
+    ssize_t n;
+
+    n = write(w->fd, cmd, sizeof(cmd));
+    timed(w, OP_WRITE, n, start);
+}
+
+static void worker_big_write(struct worker *w)
+{
+    uint64_t start;
+    ssize_t n;
+    size_t i;
+
+    for (i = 0; i < BIG_WRITE; i += 8) {
+        w->big[i] = LED_SET;
+        w->big[i + 1] = 0xff;
+        w->big[i + 2] = rand_r(&w->seed);
+    }
+    start = now_ns();
+    n = write(w->fd, w->big, BIG_WRITE);
+    timed(w, OP_BIG_WRITE, n, start);
+}
+
+static void worker_ioctl(struct worker *w)
+{
+    struct plug162_caps caps;
+    uint64_t start = now_ns();
+
+    timed(w, OP_IOCTL, ioctl(w->fd, PLUG162_IOC_GET_CAPS, &caps), start);
+}
+
+static void *worker(void *arg)
+{
+    struct worker *w = arg;
+    uint64_t start;
+    int pick;
+
+    while (!w->s->stop) {
+        if (w->fd < 0) {
+            worker_open(w);
+            continue;
+        }
+
+        pick = rand_r(&w->seed) % 100;
+        if (pick < 40) {
+            worker_read(w);
+        } else if (pick < 70) {
+            worker_write(w);
+        } else if (pick < 75) {
+            worker_big_write(w);
+        } else if (pick < 85) {
+            worker_ioctl(w);
+        } else if (pick < 90) {
+            start = now_ns();
+            timed(w, OP_FSYNC, fsync(w->fd), start);
+        } else if (pick < 95) {
+            start = now_ns();
+            timed(w, OP_CLOSE, close(w->fd), start);
+            w->fd = -1;
+        } else {
+            /* a second open of the same node, closed at once */
+            int fd = w->fd;
+
+            worker_open(w);
+            if (w->fd >= 0) {
+                start = now_ns();
+                timed(w, OP_CLOSE, close(w->fd), start);
+            }
+            w->fd = fd;
+        }
+    }
+
+    if (w->fd >= 0)
+        close(w->fd);
+    w->fd = -1;
+
+    return NULL;
+}
+
+/* the kernel log from here on, nonblocking; -1 without /dev/kmsg */
+static int kmsg_open(void)
+{
+    int fd = open("/dev/kmsg", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd >= 0)
+        lseek(fd, 0, SEEK_END);
+
+    return fd;
+}
+
+static int kmsg_check(int fd)
+{
+    char rec[8192];
+    int found = 0;
+    ssize_t n;
+    size_t i;
+    char *msg;
+
+    for (;;) {
+        n = read(fd, rec, sizeof(rec) - 1);
+        if (n < 0) {
+            if (errno == EPIPE)   /* overwritten before we got to it */
+                continue;
+            break;
+        }
+        rec[n] = '\0';
+        msg = strchr(rec, ';');
+        msg = msg ? msg + 1 : rec;
+        msg[strcspn(msg, "\n")] = '\0';
+        for (i = 0; i < sizeof(splats) / sizeof(splats[0]); i++) {
+            if (strstr(msg, splats[i])) {
+                printf("kernel: %s\n", msg);
+                found++;
+                break;
+            }
+        }
+    }
+
+    return found;
+}
+
+static int is_driver_lock(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(lock_names) / sizeof(lock_names[0]); i++)
+        if (!strncmp(name, lock_names[i], strlen(lock_names[i])))
+            return 1;
+
+    return 0;
+}
+
+/*
+ * The contention columns of the driver's lock classes. Classes with the
+ * same name in other usb-skeleton derived drivers show up as well.
+ */
+static void lock_stat_report(void)
+{
+    char line[1024], name[256];
+    unsigned long long con_bounces, contentions, acq_bounces, acquisitions;
+    double wait_min, wait_max, wait_total, wait_avg;
+    int header = 0;
+    int end;
+    FILE *f;
+
+    f = fopen(LOCK_STAT, "r");
+    if (!f) {
+        printf("no " LOCK_STAT ", lock contention not reported\n");
+        return;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        /* "name:" then the numbers, or "name-R:" for read sides */
+        end = 0;
+        if (sscanf(line, " %255[^:\n]:%n", name, &end) != 1 || !end ||
+            !is_driver_lock(name))
+            continue;
+        if (sscanf(line + end, "%llu %llu %lf %lf %lf %lf %llu %llu",
+                   &con_bounces, &contentions, &wait_min, &wait_max,
+                   &wait_total, &wait_avg, &acq_bounces,
+                   &acquisitions) != 8)
+            continue;
+        if (!header++)
+            printf("%-24s %12s %12s %12s %12s\n", "lock", "acquisitions",
+                   "contentions", "wait avg us", "wait max us");
+        printf("%-24s %12llu %12llu %12.2f %12.2f\n", name, acquisitions,
+               contentions, wait_avg, wait_max);
+    }
+    fclose(f);
+
+    if (!header)
+        printf("no contention recorded on the driver's locks\n");
+}
+
+/* writes that never completed, or whose buffers were never dropped */
+static int check_write_urbs(const char *when)
+{
+    uint64_t until = now_ns() + QUIESCE_MS * 1000000ull;
+    long n;
+
+    while ((n = read_long(WRITE_URBS)) > 0 && now_ns() < until)
+        sleep_ms(10);
+
+    if (n < 0) {
+        printf("no " WRITE_URBS ", leaks not checked\n");
+        return 0;
+    }
+    if (n > 0)
+        printf("%ld write urbs left %s\n", n, when);
+
+    return n > 0;
+}
+
+static void report(struct stress *s, struct worker *w, int nworkers,
+                   double secs)
+{
+    struct latency total;
+    unsigned long errors;
+    int op, i;
+
+    printf("%d workers, %.1f s, %lu of %lu injected events read\n",
+           nworkers, secs, s->read_events, s->injected);
+    for (i = 0; i < NR_FAULTS; i++) {
+        if (s->faulted[i])
+            printf("%-12s %lu faults, %lu failed\n", fault_names[i],
+                   s->faulted[i], s->fault_failed[i]);
+    }
+
+    printf("%-12s %10s %10s\n", "op", "ops/s", "errors");
+    for (op = 0; op < NR_OPS; op++) {
+        memset(&total, 0, sizeof(total));
+        errors = 0;
+        for (i = 0; i < nworkers; i++) {
+            lat_merge(&total, &w[i].lat[op]);
+            errors += w[i].errors[op];
+        }
+        printf("%-12s %10.0f %10lu\n", op_names[op], total.n / secs, errors);
+        lat_free(&total);
+    }
+    for (op = 0; op < NR_OPS; op++) {
+        memset(&total, 0, sizeof(total));
+        for (i = 0; i < nworkers; i++)
+            lat_merge(&total, &w[i].lat[op]);
+        lat_print(op_names[op], &total);
+        lat_free(&total);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct stress s = {
+        .cfg = { .num_leds = MAX_CHANNELS, .num_buttons = MAX_CHANNELS },
+        .faults = (1 << NR_FAULTS) - 1,
+        .fault_ms = 200,
+        .event_rate = 1000,
+    };
+    pthread_t fault_thread, inject_thread;
+    struct timespec until;
+    struct worker *w;
+    int nworkers = 8, secs = 10;
+    int opt, i, kmsg, failed = 0;
+    uint64_t t0, took;
+
+    while ((opt = getopt(argc, argv, "t:d:f:F:e:u:U:")) != -1) {
+        switch (opt) {
+        case 't':
+            nworkers = atoi(optarg);
+            break;
+        case 'd':
+            secs = atoi(optarg);
+            break;
+        case 'f':
+            s.fault_ms = atoi(optarg);
+            break;
+        case 'F':
+            s.faults = parse_faults(optarg);
+            break;
+        case 'e':
+            s.event_rate = atoi(optarg);
+            break;
+        case 'u':
+            s.cfg.udc_driver = optarg;
+            break;
+        case 'U':
+            s.cfg.udc_device = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc || nworkers < 1 || secs < 1 || s.fault_ms < 0 ||
+        s.event_rate < 1 || s.event_rate > 1000000)
+        usage();
+    if (!s.fault_ms)
+        s.faults = 0;
+
+    pthread_rwlock_init(&s.emu_lock, NULL);
+    pthread_mutex_init(&s.node_lock, NULL);
+    snprintf(s.serial, sizeof(s.serial), "stress-%d", getpid());
+    s.cfg.serial = s.serial;
+
+    if (start_emu(&s)) {
+        fprintf(stderr, "the emulated plug did not show up; are "
+                "raw_gadget, dummy_hcd and the driver loaded?\n");
+        return 1;
+    }
+
+    w = calloc(nworkers, sizeof(*w));
+    if (!w)
+        return 1;
+
+    kmsg = kmsg_open();
+    if (kmsg < 0)
+        printf("no /dev/kmsg, kernel splats not checked\n");
+    write_file(LOCK_STAT, "0");
+
+    t0 = now_ns();
+    for (i = 0; i < nworkers; i++) {
+        w[i].s = &s;
+        w[i].seed = getpid() + 2 + i;
+        w[i].fd = -1;
+        w[i].big = aligned_alloc(4096, BIG_WRITE);
+        if (!w[i].big)
+            return 1;
+        pthread_create(&w[i].thread, NULL, worker, &w[i]);
+    }
+    pthread_create(&inject_thread, NULL, injector, &s);
+    if (s.faults)
+        pthread_create(&fault_thread, NULL, faulter, &s);
+
+    sleep_ms(secs * 1000);
+    s.stop = 1;
+
+    if (s.faults)
+        pthread_join(fault_thread, NULL);
+    pthread_join(inject_thread, NULL);
+
+    /* a worker stuck in the driver is a failure of its own */
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += JOIN_WAIT_S;
+    for (i = 0; i < nworkers; i++) {
+        if (pthread_timedjoin_np(w[i].thread, NULL, &until)) {
+            printf("worker %d did not stop, stuck in the driver?\n", i);
+            failed = 1;
+        }
+    }
+    took = now_ns() - t0;
+
+    if (!failed) {
+        report(&s, w, nworkers, took / 1e9);
+        lock_stat_report();
+        failed |= check_write_urbs("with the plug idle");
+    }
+
+    pthread_rwlock_wrlock(&s.emu_lock);
+    plug162_emu_stop(s.emu);
+    s.emu = NULL;
+    pthread_rwlock_unlock(&s.emu_lock);
+
+    if (!failed)
+        failed |= check_write_urbs("after disconnect");
+    if (kmsg >= 0) {
+        failed |= kmsg_check(kmsg) > 0;
+        close(kmsg);
+    }
+
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    if (failed) {
+        fflush(stdout);
+        _exit(1);   /* stuck workers would hold up exit() */
+    }
+
+    for (i = 0; i < nworkers; i++) {
+        for (opt = 0; opt < NR_OPS; opt++)
+            lat_free(&w[i].lat[opt]);
+        free(w[i].big);
+    }
+    free(w);
+
+    return 0;
+}
@@ -7,7 +7,23 @@
 #include <linux/uaccess.h>
 #include <linux/usb.h>
 #include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+#include <linux/kfifo.h>
+#include <linux/srcu.h>
+#include <linux/ktime.h>
+#include <linux/cdev.h>
+#include <linux/idr.h>
+#include <linux/debugfs.h>
+#include <linux/hrtimer.h>
 #include "protocol.h"
+#include "plug162_ioctl.h"
+#include "plug162_capture.h"
+
+#define CREATE_TRACE_POINTS
+#include "plug162_trace.h"
 
 #define VENDOR_ID  0xdead
 #define PRODUCT_ID 0xbeef
@@ -20,41 +36,216 @@ static const struct usb_device_id plug162_table[] = {
 MODULE_DEVICE_TABLE(usb, plug162_table);
 
 
-/* Get a minor range for your devices from the usb maintainer */
-#define USB_SKEL_MINOR_BASE 192
+/*
+ * Nodes get minors of their own char region rather than from the 256
+ * shared usbmisc ones.
+ */
+#define PLUG162_MAX_DEVICES 1024
+
+static unsigned int capture_kb;
+module_param(capture_kb, uint, 0644);
+MODULE_PARM_DESC(capture_kb,
+        "traffic capture ring per device in KiB, 0 for none (read at probe)");
 #define WRITES_IN_FLIGHT 4
+/* kept for PLUG162_PRIO_URGENT writes, on top of WRITES_IN_FLIGHT */
+#define PLUG162_URGENT_WRITES 1
+
+/*
+ * Writes larger than one packet are sent straight from pinned user pages,
+ * one more than PLUG162_MAX_WRITE_PAGES as the data need not be aligned.
+ */
+#define PLUG162_MAX_PINNED_PAGES (PLUG162_MAX_WRITE_PAGES + 1)
+#define PLUG162_MAX_WRITE (PLUG162_MAX_WRITE_PAGES * PAGE_SIZE)
+#define PLUG162_FSYNC_TIMEOUT 5000 /* ms */
+
+/* stalled endpoints are cleared, then reset, with exponential backoff */
+#define PLUG162_RECOVER_BASE_MS     2
+#define PLUG162_RECOVER_DRAIN_MS    50
+#define PLUG162_RECOVER_RESET_AFTER 3
+#define PLUG162_RECOVER_MAX_TRIES   6
+
+/* events queued per button channel until a reader collects them */
+#define PLUG162_MAX_LATENCY_US  (10 * USEC_PER_SEC)
+#define PLUG162_EVENT_QUEUE_LEN 32
+
+/* bits in usb_plug162.recover_flags */
+#define PLUG162_HALT_OUT    0
+#define PLUG162_HALT_IN     1
+
+struct plug162_recover_stats {
+    unsigned long       runs;           /* runs of the recovery work */
+    unsigned long       halts_cleared;
+    unsigned long       resets;
+    unsigned long       resubmits;      /* writes sent again after a halt */
+    unsigned long       failures;       /* recoveries given up on */
+};
+
+/* capability descriptor, see REQ_GET_CAPS in protocol.h */
+struct plug162_caps_desc {
+    u8  bLength;
+    u8  bVersion;
+    u8  bNumLeds;
+    u8  bNumButtons;
+    __le16  wReadyMs;   /* CAPS_VERSION 2 */
+} __packed;
+
+/* REQ_GET_TELEMETRY, see protocol.h */
+struct plug162_telemetry_desc {
+    u8      bLength;
+    u8      bVersion;
+    __le16  wWorkMaxUs;
+    __le32  dLoops;
+    __le32  dSofs;
+    __le16  wInAborted;
+    __le16  wUnknownOps;
+    __le16  wButtonEdges;
+    __le16  wEventsDropped;
+} __packed;
+
+/*
+ * PING round trips, in log2 us buckets: bucket i counts times from 2^i to
+ * 2^(i+1) - 1 us, the last one everything longer.
+ */
+#define PLUG162_RTT_BUCKETS 20
+#define PLUG162_PING_INTERVAL   1000    /* ms, while the node is open */
+#define PLUG162_PING_MIN_INTERVAL 10
+
+struct plug162_rtt {
+    u64         count;
+    u64         lost;       /* no PONG before the next PING */
+    u32         min_us;
+    u32         max_us;
+    u32         buckets[PLUG162_RTT_BUCKETS];
+    ktime_t     sent;
+    u8          cookie;
+    bool        waiting;
+};
+
+struct plug162_qevent {
+    struct plug162_event    ev;
+    u32                     seq;    /* orders events across channels */
+};
+
+struct plug162_channel {
+    DECLARE_KFIFO(events, struct plug162_qevent, PLUG162_EVENT_QUEUE_LEN);
+    unsigned long       presses;
+    unsigned long       long_presses;
+    unsigned long       double_presses;
+};
+
+/* bits in plug162_write.flags */
+#define PLUG162_WRITE_URGENT    0   /* PLUG162_PRIO_URGENT */
+#define PLUG162_WRITE_USER      1   /* from write(), may be preempted */
+#define PLUG162_WRITE_PREEMPTED 2   /* being killed for an urgent write */
+
+/* the context of a write urb, freed with its buffer */
+struct plug162_write {
+    struct usb_plug162  *dev;
+    unsigned long       flags;
+    unsigned int        nr_pages;   /* pinned, 0 for a copied buffer */
+    struct page         *pages[PLUG162_MAX_PINNED_PAGES];
+    struct scatterlist  sg[PLUG162_MAX_PINNED_PAGES];
+    u8                  data[];     /* the copied buffer */
+};
 
 /* Structure to hold all of our device specific stuff */
 struct usb_plug162 {
     struct usb_device   *udev;          /* the usb device for this device */
     struct usb_interface    *interface;     /* the interface for this device */
     struct semaphore    limit_sem;      /* limiting the number of writes in progress */
+    struct semaphore    urgent_sem;     /* the slots of urgent writes */
     struct mutex        read_mutex;     /* limit to only one read in progress */
     struct usb_anchor   submitted;      /* in case we need to retract our submissions */
+    struct usb_anchor   halted;         /* writes failed on a stalled endpoint */
+    struct usb_anchor   deferred;       /* writes queued behind the halted ones */
+    struct usb_anchor   parked_urgent;  /* urgent writes halted or deferred */
     struct urb      *int_in_urb;       /* the urb to read data with */
     unsigned char   *int_in_buf;
-    size_t          int_in_filled;
     size_t          int_in_size;
     size_t          int_out_size;
     __u8            int_in_ep_addr;   
     __u8            int_out_ep_addr;  
     __u8            int_out_ep_interval;
     __u8            int_in_ep_interval;
-    int         errors;         /* the last request tanked */
+    int         minor;
+    struct device       *node;          /* /dev/plug162N */
+    __u8            caps_version;
+    __u8            num_leds;
+    __u8            num_buttons;
+    unsigned int        device_ready_ms;    /* reset to configured, on the device */
+    ktime_t         probe_start;
+    s64             probe_us;       /* probe to the node being registered */
+    atomic64_t      first_urb_us;       /* probe to the first good transfer */
+    struct plug162_channel  channels[MAX_CHANNELS];
+    u32             event_seq;      /* only touched by the read callback */
+    unsigned long       events_dropped;
+    int             in_error;       /* the int-in urb is dead, readers get this */
+    struct kfifo        capture;        /* see plug162_capture.h */
+    spinlock_t      capture_lock;
+    u32             capture_dropped;    /* since the last record */
+    u32             capture_lost;
+    struct dentry       *debugfs;
+    atomic_t        errors;         /* the last request tanked */
+    atomic_t        writes_in_flight;   /* writes holding a slot, urgent too */
+    atomic_t        urgent_in_flight;
+    atomic_long_t   writes_cancelled;   /* by PLUG162_PRIO_CANCEL */
     int         open_count;     /* count the number of openers */
-    bool            ongoing_read;       /* a read is going on */
+    bool            ongoing_read;       /* the int-in urb is kept armed */
     bool            processed_urb;      /* indicates we haven't processed the urb */
-    spinlock_t      err_lock;       /* lock for errors */
+    bool            in_reset;       /* between pre_reset and post_reset */
+    bool            gone;           /* disconnected, see plug162_srcu */
+    bool            quiesced;       /* writes must take io_mutex, see draw_down */
+    bool            preempting;     /* an urgent write is overtaking */
     struct kref     kref;
     struct mutex        io_mutex;       /* synchronize I/O with disconnect */
-    struct completion   int_in_completion; /* to wait for an ongoing read */
+    struct list_head    files;          /* open plug162_files, for wakeups */
+    spinlock_t      files_lock;
+    wait_queue_head_t   write_wait;     /* woken when a write slot frees up */
+    struct delayed_work recover_work;   /* clears halts and resubmits */
+    unsigned long       recover_flags;  /* endpoints waiting for recovery */
+    unsigned int        recover_attempts;   /* since the last good transfer */
+    struct plug162_recover_stats recover_stats; /* under io_mutex */
+    struct delayed_work ping_work;
+    unsigned int        ping_interval_ms;   /* 0 stops pinging */
+    spinlock_t      rtt_lock;
+    struct plug162_rtt  rtt;
+};
+
+/* per open file */
+struct plug162_file {
+    struct usb_plug162  *dev;
+    u32                 channels;   /* button channels read by this file */
+    u32                 priority;   /* PLUG162_PRIO_* for its writes */
+    struct list_head    list;       /* in dev->files */
+    wait_queue_head_t   wait;       /* readers and pollers of this file */
+    /* wakeup moderation, see PLUG162_IOC_SET_MODERATION */
+    u32                 batch;
+    u32                 max_latency_us;
+    struct hrtimer      timer;      /* max_latency_us after the first event */
+    bool                due;        /* the deadline passed, events waiting;
+                                       set and cleared under files_lock */
 };
 
 #define to_usb_dev(d) container_of(d, struct usb_plug162, kref)
 
-/* static struct usb_driver driver; */
-static void plug162_draw_down(struct usb_plug162 *dev);
-static struct usb_driver plug162_driver;
+/* write fast paths run under this instead of io_mutex */
+DEFINE_STATIC_SRCU(plug162_srcu);
+
+/*
+ * Write urbs holding a buffer or pinned pages, across all devices. It
+ * outlives disconnect, so a stress run can check it drops back to 0.
+ */
+static atomic_t plug162_write_urbs = ATOMIC_INIT(0);
+
+/* minor to device, for open() */
+static DEFINE_IDR(plug162_idr);
+static DEFINE_MUTEX(plug162_idr_lock);
+static dev_t plug162_devt;
+static struct cdev plug162_cdev;
+
+static bool plug162_draw_down(struct usb_plug162 *dev);
+static void plug162_start_pinging(struct usb_plug162 *dev);
+static enum hrtimer_restart plug162_moderation_timer(struct hrtimer *timer);
 
 static void plug162_delete(struct kref *kref)
 {
@@ -62,327 +253,1931 @@ static void plug162_delete(struct kref *kref)
 
     usb_free_urb(dev->int_in_urb);
     kfree(dev->int_in_buf);
+    kfifo_free(&dev->capture);
     usb_put_dev(dev->udev);
     kfree(dev);
 }
 
+/* called with io_mutex held when the first opener arrives */
+static int plug162_start_reading(struct usb_plug162 *dev)
+{
+    int i;
+    int rv;
+
+    /* nothing else touches the queues while the urb is idle */
+    for (i = 0; i < MAX_CHANNELS; i++)
+        kfifo_reset(&dev->channels[i].events);
+    dev->in_error = 0;
+    dev->ongoing_read = true;
+
+    rv = usb_submit_urb(dev->int_in_urb, GFP_KERNEL);
+    if (rv < 0) {
+        printk(KERN_ERR "%s - failed submitting read urb, error %d",
+            __func__, rv);
+        dev->ongoing_read = false;
+        return rv;
+    }
+
+    plug162_start_pinging(dev);
+
+    return 0;
+}
+
 static int plug162_open(struct inode *inode, struct file *file)
 {
+    struct usb_interface *interface = NULL;
     struct usb_plug162 *dev;
-    struct usb_interface *intf;
+    struct plug162_file *pf;
     int subminor;
     int ret = 0;
     
     subminor = iminor(inode);
-    intf = usb_find_interface(&plug162_driver, subminor);
-    
-    if (intf == NULL) {
+
+    pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+    if (pf == NULL) {
+        ret = -ENOMEM;
+        goto exit;
+    }
+
+    mutex_lock(&plug162_idr_lock);
+    dev = idr_find(&plug162_idr, subminor);
+    if (dev) {
+        kref_get(&dev->kref);
+        interface = usb_get_intf(dev->interface);
+    }
+    mutex_unlock(&plug162_idr_lock);
+
+    if (dev == NULL) {
         printk(KERN_ERR "%s - error, can't find device for minor %d\n",
             __func__, subminor);
+        kfree(pf);
         ret = -ENODEV;
         goto exit;
     }
+    pf->dev = dev;
+    pf->channels = ~0U;
+    init_waitqueue_head(&pf->wait);
+    hrtimer_setup(&pf->timer, plug162_moderation_timer, CLOCK_MONOTONIC,
+            HRTIMER_MODE_REL);
+
+    /* each file holds the device awake; resuming takes io_mutex */
+    ret = usb_autopm_get_interface(interface);
+    usb_put_intf(interface);
+    if (ret)
+        goto error;
 
-    dev = usb_get_intfdata(intf);
-    if (dev == NULL) {
+    mutex_lock(&dev->io_mutex);
+
+    /* disconnect has dropped our autopm reference with the others */
+    if (dev->interface == NULL) {
         ret = -ENODEV;
-        goto exit;
+        goto error_unlock;
+    }
+
+    if (!dev->open_count) {
+        ret = plug162_start_reading(dev);
+        if (ret) {
+            usb_autopm_put_interface_async(dev->interface);
+            goto error_unlock;
+        }
     }
+    dev->open_count++;
+
+    file->private_data = pf;
+    spin_lock_irq(&dev->files_lock);
+    list_add_tail(&pf->list, &dev->files);
+    spin_unlock_irq(&dev->files_lock);
+    mutex_unlock(&dev->io_mutex);
+
+    return 0;
+
+error_unlock:
+    mutex_unlock(&dev->io_mutex);
+error:
+    kref_put(&dev->kref, plug162_delete);
+    kfree(pf);
+exit:
+    return ret;
+}
+
+static int plug162_release(struct inode *inode, struct file *file)
+{
+    struct plug162_file *pf;
+    struct usb_plug162 *dev;
 
-    kref_get(&dev->kref);
+    pf = file->private_data;
+    if (pf == NULL)
+        return -ENODEV;
+    dev = pf->dev;
 
+    spin_lock_irq(&dev->files_lock);
+    list_del(&pf->list);
+    spin_unlock_irq(&dev->files_lock);
+    hrtimer_cancel(&pf->timer);
+    kfree(pf);
+    
+    /* stop polling and allow the device to be autosuspended */
     mutex_lock(&dev->io_mutex);
+    if (!--dev->open_count && dev->interface) {
+        dev->ongoing_read = false;
+        cancel_delayed_work(&dev->ping_work);
+        usb_kill_urb(dev->int_in_urb);
+    }
+    /* suspending takes io_mutex, so it must not run from here */
+    if (dev->interface)
+        usb_autopm_put_interface_async(dev->interface);
+    mutex_unlock(&dev->io_mutex);
 
-    if (!dev->open_count++) {
-        ret = usb_autopm_get_interface(intf);
-        if (ret) {
-            dev->open_count--;
-            mutex_unlock(&dev->io_mutex);
-            kref_put(&dev->kref, plug162_delete);
+    /* decrement the count on our device */
+    kref_put(&dev->kref, plug162_delete);
+    
+    return 0;
+}
+
+static int plug162_flush(struct file *file, fl_owner_t id)
+{
+    return 0;
+}
+
+/* stalls and transient bus errors are handed to the recovery work */
+static bool plug162_recoverable(int status)
+{
+    return status == -EPIPE || status == -EPROTO ||
+        status == -EILSEQ || status == -ETIME;
+}
+
+static unsigned long plug162_recover_delay(struct usb_plug162 *dev)
+{
+    unsigned int attempts = READ_ONCE(dev->recover_attempts);
+
+    if (!attempts)
+        return 0;
+
+    return msecs_to_jiffies(PLUG162_RECOVER_BASE_MS << min(attempts - 1, 8u));
+}
+
+static void plug162_schedule_recovery(struct usb_plug162 *dev, int halt,
+                int status)
+{
+    set_bit(halt, &dev->recover_flags);
+    trace_plug162_recovery(dev->minor, PLUG162_RECOVER_STALL, status,
+            READ_ONCE(dev->recover_attempts));
+    schedule_delayed_work(&dev->recover_work, plug162_recover_delay(dev));
+}
+
+/* events queued on the channels this file reads */
+static unsigned int plug162_pending(struct usb_plug162 *dev,
+                struct plug162_file *pf)
+{
+    u32 mask = READ_ONCE(pf->channels);
+    unsigned int n = 0;
+    int i;
+
+    for (i = 0; i < dev->num_buttons; i++)
+        if (mask & BIT(i))
+            n += kfifo_len(&dev->channels[i].events);
+
+    return n;
+}
+
+/* whether a blocked reader of @pf should have the events by now */
+static bool plug162_file_ready(struct usb_plug162 *dev,
+                struct plug162_file *pf)
+{
+    unsigned int n = plug162_pending(dev, pf);
+
+    return n && (n >= max(READ_ONCE(pf->batch), 1U) || READ_ONCE(pf->due));
+}
+
+static enum hrtimer_restart plug162_moderation_timer(struct hrtimer *timer)
+{
+    struct plug162_file *pf = container_of(timer, struct plug162_file, timer);
+    struct usb_plug162 *dev = pf->dev;
+    unsigned long flags;
+
+    /* a reader may have drained the events in the meantime */
+    spin_lock_irqsave(&dev->files_lock, flags);
+    if (plug162_pending(dev, pf)) {
+        WRITE_ONCE(pf->due, true);
+        wake_up_interruptible(&pf->wait);
+    }
+    spin_unlock_irqrestore(&dev->files_lock, flags);
+
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * After a completion: wake the files with a full batch or a passed
+ * deadline, and start the deadline of those that got their first
+ * events. Without moderation a file is woken for every completion that
+ * brought it events.
+ */
+static void plug162_wake_readers(struct usb_plug162 *dev)
+{
+    struct plug162_file *pf;
+    unsigned long flags;
+    unsigned int n;
+
+    spin_lock_irqsave(&dev->files_lock, flags);
+    list_for_each_entry(pf, &dev->files, list) {
+        n = plug162_pending(dev, pf);
+        if (!n)
+            continue;
+        if (n >= max(pf->batch, 1U) || pf->due) {
+            hrtimer_try_to_cancel(&pf->timer);
+            wake_up_interruptible(&pf->wait);
+        } else if (pf->max_latency_us && !hrtimer_is_queued(&pf->timer)) {
+            hrtimer_start(&pf->timer, us_to_ktime(pf->max_latency_us),
+                    HRTIMER_MODE_REL);
+        }
+    }
+    spin_unlock_irqrestore(&dev->files_lock, flags);
+}
+
+/* for errors and disconnect, which every reader has to see */
+static void plug162_wake_all_readers(struct usb_plug162 *dev)
+{
+    struct plug162_file *pf;
+    unsigned long flags;
+
+    spin_lock_irqsave(&dev->files_lock, flags);
+    list_for_each_entry(pf, &dev->files, list)
+        wake_up_interruptible_all(&pf->wait);
+    spin_unlock_irqrestore(&dev->files_lock, flags);
+}
+
+/* wake readers for good, the int-in urb will not be resubmitted */
+static void plug162_fail_reads(struct usb_plug162 *dev, int error)
+{
+    WRITE_ONCE(dev->in_error, error);
+    plug162_wake_all_readers(dev);
+}
+
+/* @frame, the device's USB frame number, is there for tracing only */
+static void plug162_pong(struct usb_plug162 *dev, u8 cookie, u16 frame)
+{
+    struct plug162_rtt *rtt = &dev->rtt;
+    unsigned long flags;
+    u32 us;
+
+    spin_lock_irqsave(&dev->rtt_lock, flags);
+    if (!rtt->waiting || cookie != rtt->cookie)
+        goto out;
+    rtt->waiting = false;
+
+    us = clamp_t(s64, ktime_us_delta(ktime_get(), rtt->sent), 1, U32_MAX);
+    if (!rtt->count || us < rtt->min_us)
+        rtt->min_us = us;
+    rtt->max_us = max(rtt->max_us, us);
+    rtt->buckets[min(ilog2(us), PLUG162_RTT_BUCKETS - 1)]++;
+    rtt->count++;
+
+out:
+    spin_unlock_irqrestore(&dev->rtt_lock, flags);
+}
+
+static void plug162_queue_event(struct usb_plug162 *dev,
+                const unsigned char *data)
+{
+    struct plug162_qevent qe;
+    struct plug162_channel *ch;
+
+    if (data[0] == PONG) {
+        plug162_pong(dev, data[1], data[2] | (data[3] << 8));
+        return;
+    }
+
+    qe.ev.type = data[0];
+    qe.ev.channel = data[1];
+    qe.ev.arg = data[2] | (data[3] << 8);
+    qe.seq = dev->event_seq++;
+
+    if (qe.ev.channel >= dev->num_buttons) {
+        dev->events_dropped++;
+        return;
+    }
+
+    ch = &dev->channels[qe.ev.channel];
+    switch (qe.ev.type) {
+    case BUTTON_DOWN:
+        ch->presses++;
+        break;
+    case BUTTON_LONG_PRESS:
+        ch->long_presses++;
+        break;
+    case BUTTON_DOUBLE_PRESS:
+        ch->double_presses++;
+        break;
+    }
+    if (!kfifo_put(&ch->events, qe))
+        dev->events_dropped++;
+}
+
+static void plug162_queue_events(struct usb_plug162 *dev,
+                const unsigned char *buf, size_t len)
+{
+    unsigned char legacy[EVENT_SIZE] = { 0 };
+    size_t off;
+
+    if (!len)
+        return;
+
+    /* firmware without channels sends just the event type */
+    if (len < EVENT_SIZE) {
+        memcpy(legacy, buf, len);
+        plug162_queue_event(dev, legacy);
+    } else {
+        for (off = 0; off + EVENT_SIZE <= len; off += EVENT_SIZE)
+            plug162_queue_event(dev, buf + off);
+    }
+
+    plug162_wake_readers(dev);
+}
+
+/*
+ * Records @len bytes of @urb's data, from its scatterlist for pinned
+ * writes. Nothing is recorded unless capture_kb was set at probe.
+ */
+static void plug162_capture_urb(struct usb_plug162 *dev, u8 dir,
+                struct urb *urb, u32 len)
+{
+    struct plug162_capture_record rec = {
+        .ts_ns = ktime_get_ns(),
+        .len = len,
+        .dir = dir,
+    };
+    struct sg_mapping_iter miter;
+    unsigned long flags;
+    u32 left = len;
+
+    if (!kfifo_initialized(&dev->capture))
+        return;
+
+    spin_lock_irqsave(&dev->capture_lock, flags);
+    if (kfifo_avail(&dev->capture) < sizeof(rec) + len) {
+        dev->capture_dropped++;
+        dev->capture_lost++;
+        goto out;
+    }
+    rec.dropped = dev->capture_dropped;
+    dev->capture_dropped = 0;
+    kfifo_in(&dev->capture, (u8 *)&rec, sizeof(rec));
+
+    if (!urb->num_sgs) {
+        kfifo_in(&dev->capture, (u8 *)urb->transfer_buffer, len);
+        goto out;
+    }
+
+    sg_miter_start(&miter, urb->sg, urb->num_sgs,
+            SG_MITER_ATOMIC | SG_MITER_FROM_SG);
+    while (left && sg_miter_next(&miter)) {
+        size_t n = min_t(size_t, left, miter.length);
+
+        kfifo_in(&dev->capture, (u8 *)miter.addr, n);
+        left -= n;
+    }
+    sg_miter_stop(&miter);
+
+out:
+    spin_unlock_irqrestore(&dev->capture_lock, flags);
+}
+
+/* the first good transfer after probe, how long replug recovery takes */
+static void plug162_mark_ready(struct usb_plug162 *dev)
+{
+    s64 us;
+
+    if (atomic64_read(&dev->first_urb_us))
+        return;
+
+    us = max_t(s64, ktime_us_delta(ktime_get(), dev->probe_start), 1);
+    if (atomic64_cmpxchg(&dev->first_urb_us, 0, us) == 0)
+        trace_plug162_ready(dev->minor, PLUG162_READY_FIRST_URB, us);
+}
+
+static void plug162_read_int_callback(struct urb *urb)
+{
+    struct usb_plug162 *dev;
+    int status = urb->status;
+    int rv;
+    
+    dev = urb->context;
+
+    /* the urb is resubmitted once the halt is cleared */
+    if (plug162_recoverable(status)) {
+        plug162_schedule_recovery(dev, PLUG162_HALT_IN, status);
+        return;
+    }
+
+    switch (status) {
+    case 0:
+        plug162_capture_urb(dev, PLUG162_CAPTURE_IN, urb, urb->actual_length);
+        plug162_queue_events(dev, urb->transfer_buffer, urb->actual_length);
+        WRITE_ONCE(dev->recover_attempts, 0);
+        plug162_mark_ready(dev);
+        break;
+    /* sync/async unlink faults aren't errors */
+    case -ENOENT:
+    case -ECONNRESET:
+    case -ESHUTDOWN:
+        /* last close, suspend, reset or disconnect rearm as needed */
+        return;
+    default:
+        printk(KERN_DEBUG "%s - nonzero read int status received: %d",
+            __func__, status);
+        atomic_set(&dev->errors, status);
+        break;
+    }
+
+    rv = usb_submit_urb(urb, GFP_ATOMIC);
+    if (rv < 0) {
+        printk(KERN_ERR "%s - failed resubmitting read urb, error %d",
+            __func__, rv);
+        plug162_fail_reads(dev, rv);
+    }
+}
+
+/* the channel in @mask holding the oldest event, or NULL if none has any */
+static struct plug162_channel *plug162_next_channel(struct usb_plug162 *dev,
+                u32 mask)
+{
+    struct plug162_channel *next = NULL;
+    struct plug162_qevent head;
+    u32 seq = 0;
+    int i;
+
+    for (i = 0; i < dev->num_buttons; i++) {
+        if (!(mask & BIT(i)))
+            continue;
+        if (!kfifo_peek(&dev->channels[i].events, &head))
+            continue;
+        if (next == NULL || (s32)(head.seq - seq) < 0) {
+            next = &dev->channels[i];
+            seq = head.seq;
+        }
+    }
+
+    return next;
+}
+
+/*
+ * Returns as many whole events as fit in @count. A buffer shorter than
+ * one event gets its first bytes, so one-byte reads still see the type.
+ */
+static ssize_t plug162_read(struct file *file, char *buf, size_t count,
+                loff_t *ppos)
+{
+    struct plug162_file *pf;
+    struct usb_plug162 *dev;
+    struct plug162_channel *ch;
+    struct plug162_qevent qe;
+    size_t copied = 0;
+    size_t len;
+    int rv = 0;
+
+    pf = file->private_data;
+    dev = pf->dev;
+    if (count == 0)
+        return 0;
+    
+    /*
+     * read_mutex only serialises dequeuing; waiting is done without it,
+     * so a reader of a quiet channel does not hold up the others. It is
+     * held briefly, so even O_NONBLOCK readers take it: -EAGAIN has to
+     * mean that the queues are empty, as epoll users read until then.
+     */
+    for (;;) {
+        mutex_lock(&dev->read_mutex);
+
+        ch = plug162_next_channel(dev, READ_ONCE(pf->channels));
+        if (ch)
+            break;
+        mutex_unlock(&dev->read_mutex);
+
+        rv = READ_ONCE(dev->in_error);
+        if (rv < 0)
+            return rv;
+        if (file->f_flags & O_NONBLOCK)
+            return -EAGAIN;
+        rv = wait_event_interruptible(pf->wait,
+                plug162_file_ready(dev, pf) || READ_ONCE(dev->in_error));
+        if (rv < 0)
+            return rv;
+    }
+
+    do {
+        if (!kfifo_get(&ch->events, &qe))
+            break;
+        len = min(count - copied, sizeof(qe.ev));
+        if (copy_to_user(buf + copied, &qe.ev, len)) {
+            rv = copied ? copied : -EFAULT;
             goto exit;
         }
+        copied += len;
+    } while (copied + sizeof(qe.ev) <= count &&
+        (ch = plug162_next_channel(dev, READ_ONCE(pf->channels))));
+
+    /* the next deadline starts with the next event */
+    spin_lock_irq(&dev->files_lock);
+    if (!plug162_pending(dev, pf)) {
+        WRITE_ONCE(pf->due, false);
+        hrtimer_try_to_cancel(&pf->timer);
     }
+    spin_unlock_irq(&dev->files_lock);
+
+    rv = copied;
+
+exit:
+    mutex_unlock(&dev->read_mutex);
+
+    return rv;
+}
+
+/* report and clear the sticky error of an earlier request */
+static int plug162_take_error(struct usb_plug162 *dev)
+{
+    int rv = atomic_xchg(&dev->errors, 0);
+
+    if (rv < 0)
+        rv = (rv == -EPIPE) ? rv : -EIO;
+
+    return rv;
+}
+
+static struct plug162_write *plug162_alloc_write(struct usb_plug162 *dev,
+                size_t copied)
+{
+    struct plug162_write *w;
+
+    w = kzalloc(struct_size(w, data, copied), GFP_KERNEL);
+    if (w)
+        w->dev = dev;
+
+    return w;
+}
+
+static void plug162_release_write_buf(struct urb *urb)
+{
+    struct plug162_write *w = urb->context;
+
+    atomic_dec(&plug162_write_urbs);
+    if (w->nr_pages)
+        unpin_user_pages(w->pages, w->nr_pages);
+    kfree(w);
+}
+
+static bool plug162_urb_urgent(struct urb *urb)
+{
+    struct plug162_write *w = urb->context;
+
+    return test_bit(PLUG162_WRITE_URGENT, &w->flags);
+}
+
+static int plug162_take_write_slot(struct usb_plug162 *dev, bool urgent,
+                bool nowait)
+{
+    struct semaphore *sem = urgent ? &dev->urgent_sem : &dev->limit_sem;
+
+    if (nowait) {
+        if (down_trylock(sem))
+            return -EAGAIN;
+    } else if (down_interruptible(sem)) {
+        return -ERESTARTSYS;
+    }
+    atomic_inc(&dev->writes_in_flight);
+    if (urgent)
+        atomic_inc(&dev->urgent_in_flight);
+
+    return 0;
+}
+
+static void plug162_put_write_slot(struct usb_plug162 *dev, bool urgent)
+{
+    atomic_dec(&dev->writes_in_flight);
+    if (urgent) {
+        atomic_dec(&dev->urgent_in_flight);
+        up(&dev->urgent_sem);
+    } else {
+        up(&dev->limit_sem);
+    }
+    wake_up_interruptible(&dev->write_wait);
+}
+
+static void plug162_write_int_callback(struct urb *urb)
+{
+    struct plug162_write *w = urb->context;
+    struct usb_plug162 *dev = w->dev;
+
+    /* plug162_preempt_writes() takes it from here */
+    if (urb->status == -ENOENT &&
+        test_bit(PLUG162_WRITE_PREEMPTED, &w->flags))
+        return;
+
+    /* park the urb, with its slot, until the halt has been cleared */
+    if (plug162_recoverable(urb->status)) {
+        usb_anchor_urb(urb, plug162_urb_urgent(urb) ?
+                &dev->parked_urgent : &dev->halted);
+        plug162_schedule_recovery(dev, PLUG162_HALT_OUT, urb->status);
+        return;
+    }
+
+    if (urb->status) {
+        if (!(urb->status == -ENOENT ||
+            urb->status == -ECONNRESET || 
+            urb->status == -ESHUTDOWN)) {
+            printk(KERN_DEBUG "%s - nonzero write int status received: %d",
+                    __func__, urb->status);
+            atomic_set(&dev->errors, urb->status);
+        }
+
+    } else {
+        WRITE_ONCE(dev->recover_attempts, 0);
+        plug162_mark_ready(dev);
+    }
+    
+    plug162_put_write_slot(dev, plug162_urb_urgent(urb));
+    plug162_release_write_buf(urb);
+}
+
+/*
+ * The host controller splits the transfer into int_out_size packets, so
+ * every scatterlist segment but the last has to end on a packet boundary
+ * unless the controller lifts that restriction.
+ */
+static bool plug162_can_pin(struct usb_plug162 *dev, const char __user *buf,
+                size_t len)
+{
+    struct usb_bus *bus = dev->udev->bus;
+
+    if (len <= dev->int_out_size || bus->sg_tablesize < PLUG162_MAX_PINNED_PAGES)
+        return false;
+
+    return bus->no_sg_constraint ||
+        IS_ALIGNED(offset_in_page(buf), dev->int_out_size);
+}
+
+static int plug162_fill_pinned_urb(struct usb_plug162 *dev, struct urb *urb,
+                const char __user *user_buf, size_t len)
+{
+    struct plug162_write *w;
+    unsigned long start = (unsigned long)user_buf;
+    unsigned int offset = offset_in_page(start);
+    size_t remain = len;
+    int nr_pages;
+    int pinned;
+    int i;
+
+    nr_pages = DIV_ROUND_UP(offset + len, PAGE_SIZE);
+
+    w = plug162_alloc_write(dev, 0);
+    if (w == NULL)
+        return -ENOMEM;
+
+    /* the device only reads from these pages, so no FOLL_WRITE */
+    pinned = pin_user_pages_fast(start & PAGE_MASK, nr_pages, 0, w->pages);
+    if (pinned != nr_pages) {
+        if (pinned > 0)
+            unpin_user_pages(w->pages, pinned);
+        kfree(w);
+        return pinned < 0 ? pinned : -EFAULT;
+    }
+    w->nr_pages = nr_pages;
+
+    sg_init_table(w->sg, nr_pages);
+    for (i = 0; i < nr_pages; i++) {
+        unsigned int seg = min_t(size_t, remain, PAGE_SIZE - offset);
+
+        sg_set_page(&w->sg[i], w->pages[i], seg, offset);
+        remain -= seg;
+        offset = 0;
+    }
+
+    usb_fill_int_urb(urb, dev->udev,
+                usb_sndintpipe(dev->udev, dev->int_out_ep_addr),
+                NULL, len, plug162_write_int_callback, w,
+                dev->int_out_ep_interval);
+    urb->sg = w->sg;
+    urb->num_sgs = nr_pages;
+    atomic_inc(&plug162_write_urbs);
+
+    return 0;
+}
+
+static int plug162_fill_copied_urb(struct usb_plug162 *dev, struct urb *urb,
+                const char __user *user_buf, size_t len)
+{
+    struct plug162_write *w;
+
+    w = plug162_alloc_write(dev, len);
+    if (w == NULL)
+        return -ENOMEM;
+
+    if (copy_from_user(w->data, user_buf, len)) {
+        kfree(w);
+        return -EFAULT;
+    }
+
+    usb_fill_int_urb(urb, dev->udev,
+                usb_sndintpipe(dev->udev, dev->int_out_ep_addr),
+                w->data, len, plug162_write_int_callback, w,
+                dev->int_out_ep_interval);
+    atomic_inc(&plug162_write_urbs);
+
+    return 0;
+}
+
+static int plug162_anchor_and_submit(struct usb_plug162 *dev, struct urb *urb)
+{
+    int rv;
+
+    usb_anchor_urb(urb, &dev->submitted);
+    rv = usb_submit_urb(urb, GFP_KERNEL);
+    if (rv < 0)
+        usb_unanchor_urb(urb);
+
+    return rv;
+}
+
+/*
+ * Writers only hold an SRCU read lock, so any number of them submit in
+ * parallel up to WRITES_IN_FLIGHT. Disconnect, pre_reset, suspend and
+ * urgent writes set their flag and synchronize_srcu() before touching
+ * the anchor; writers that see a flag, or a pending halt recovery, fall
+ * back to io_mutex.
+ */
+static int plug162_submit_write(struct usb_plug162 *dev, struct urb *urb)
+{
+    int idx;
+    int rv;
+
+    plug162_capture_urb(dev, PLUG162_CAPTURE_OUT, urb,
+            urb->transfer_buffer_length);
+
+    idx = srcu_read_lock(&plug162_srcu);
+    if (READ_ONCE(dev->gone)) {
+        srcu_read_unlock(&plug162_srcu, idx);
+        return -ENODEV;
+    }
+    if (!READ_ONCE(dev->quiesced) && !READ_ONCE(dev->preempting) &&
+        !test_bit(PLUG162_HALT_OUT, &dev->recover_flags)) {
+        rv = plug162_anchor_and_submit(dev, urb);
+        srcu_read_unlock(&plug162_srcu, idx);
+        return rv;
+    }
+    srcu_read_unlock(&plug162_srcu, idx);
+
+    mutex_lock(&dev->io_mutex);
+    if (dev->interface == NULL) {
+        rv = -ENODEV;
+    } else if (test_bit(PLUG162_HALT_OUT, &dev->recover_flags) ||
+            dev->quiesced) {
+        /* keep the order of commands behind a stalled one, or a suspend */
+        usb_anchor_urb(urb, plug162_urb_urgent(urb) ?
+                &dev->parked_urgent : &dev->deferred);
+        rv = 0;
+    } else {
+        rv = plug162_anchor_and_submit(dev, urb);
+    }
+    mutex_unlock(&dev->io_mutex);
+
+    return rv;
+}
+
+/*
+ * Sends a command of the driver's own, taking a write slot like write().
+ * With @nowait it fails rather than wait for one.
+ */
+static int plug162_send_command(struct usb_plug162 *dev, const u8 *cmd,
+                size_t len, bool nowait)
+{
+    struct plug162_write *w;
+    struct urb *urb;
+    int rv;
+
+    rv = plug162_take_write_slot(dev, false, nowait);
+    if (rv < 0)
+        return rv;
+
+    urb = usb_alloc_urb(0, GFP_KERNEL);
+    if (urb == NULL) {
+        rv = -ENOMEM;
+        goto error;
+    }
+    w = plug162_alloc_write(dev, len);
+    if (w == NULL) {
+        rv = -ENOMEM;
+        goto error_free;
+    }
+    memcpy(w->data, cmd, len);
+
+    usb_fill_int_urb(urb, dev->udev,
+                usb_sndintpipe(dev->udev, dev->int_out_ep_addr),
+                w->data, len, plug162_write_int_callback, w,
+                dev->int_out_ep_interval);
+    atomic_inc(&plug162_write_urbs);
+
+    rv = plug162_submit_write(dev, urb);
+    if (rv < 0)
+        goto error_release;
+
+    usb_free_urb(urb);
+
+    return 0;
+
+error_release:
+    plug162_release_write_buf(urb);
+error_free:
+    usb_free_urb(urb);
+error:
+    plug162_put_write_slot(dev, false);
+
+    return rv;
+}
+
+/*
+ * One PING in flight at a time, while the node is open and the int-in
+ * urb is there to carry the PONG back. A ping that finds every write
+ * slot taken is skipped rather than queued behind the writers.
+ */
+static void plug162_ping_work(struct work_struct *work)
+{
+    struct usb_plug162 *dev = container_of(work, struct usb_plug162,
+            ping_work.work);
+    unsigned int interval = READ_ONCE(dev->ping_interval_ms);
+    u8 cmd[2] = { PING };
+
+    if (!interval || !READ_ONCE(dev->ongoing_read) || READ_ONCE(dev->gone))
+        return;
+
+    spin_lock_irq(&dev->rtt_lock);
+    if (dev->rtt.waiting)
+        dev->rtt.lost++;
+    cmd[1] = ++dev->rtt.cookie;
+    dev->rtt.waiting = true;
+    dev->rtt.sent = ktime_get();
+    spin_unlock_irq(&dev->rtt_lock);
+
+    if (plug162_send_command(dev, cmd, sizeof(cmd), true) < 0) {
+        spin_lock_irq(&dev->rtt_lock);
+        dev->rtt.waiting = false;
+        spin_unlock_irq(&dev->rtt_lock);
+    }
+
+    schedule_delayed_work(&dev->ping_work, msecs_to_jiffies(interval));
+}
+
+static void plug162_start_pinging(struct usb_plug162 *dev)
+{
+    unsigned int interval = READ_ONCE(dev->ping_interval_ms);
+
+    if (interval)
+        mod_delayed_work(system_wq, &dev->ping_work,
+                msecs_to_jiffies(interval));
+}
+
+/*
+ * Skips what the device took of a write urb stopped early, by a halt or
+ * an urgent write, so it is not sent twice. True if it took everything.
+ */
+static bool plug162_write_advance(struct urb *urb)
+{
+    u32 done = urb->actual_length;
+
+    if (done >= urb->transfer_buffer_length)
+        return true;
+    urb->actual_length = 0;
+    urb->transfer_buffer_length -= done;
+    if (!urb->num_sgs) {
+        urb->transfer_buffer += done;
+        return false;
+    }
+
+    while (done >= urb->sg->length) {
+        done -= urb->sg->length;
+        urb->sg = sg_next(urb->sg);
+        urb->num_sgs--;
+    }
+    urb->sg->offset += done;
+    urb->sg->length -= done;
+
+    return false;
+}
+
+/*
+ * Called with io_mutex held and fast path writers held off. Kills the
+ * user writes queued at the host controller, newest first so that none
+ * starts meanwhile, and returns them in order in @requeue to be sent
+ * again after the urgent write. The one on the wire resumes where it
+ * stopped; with @cancel, those that had not started are dropped. The
+ * driver's own commands are a packet each and left alone.
+ */
+static int plug162_preempt_writes(struct usb_plug162 *dev, bool cancel,
+                struct urb **requeue)
+{
+    struct urb *victims[WRITES_IN_FLIGHT];
+    struct plug162_write *w;
+    struct urb *urb;
+    int n = 0;
+    int k = 0;
+    int i;
+
+    /* completion unanchors first, so a listed urb still has its context */
+    spin_lock_irq(&dev->submitted.lock);
+    list_for_each_entry(urb, &dev->submitted.urb_list, anchor_list) {
+        w = urb->context;
+        if (!test_bit(PLUG162_WRITE_USER, &w->flags) ||
+            test_bit(PLUG162_WRITE_URGENT, &w->flags) ||
+            n == ARRAY_SIZE(victims))
+            continue;
+        set_bit(PLUG162_WRITE_PREEMPTED, &w->flags);
+        victims[n++] = usb_get_urb(urb);
+    }
+    spin_unlock_irq(&dev->submitted.lock);
+
+    for (i = n - 1; i >= 0; i--)
+        usb_kill_urb(victims[i]);
+
+    for (i = 0; i < n; i++) {
+        urb = victims[i];
+        /* otherwise it completed, or halted, and was handled */
+        if (urb->status != -ENOENT) {
+            usb_put_urb(urb);
+            continue;
+        }
+
+        w = urb->context;
+        clear_bit(PLUG162_WRITE_PREEMPTED, &w->flags);
+        if (cancel && !urb->actual_length) {
+            atomic_long_inc(&dev->writes_cancelled);
+        } else if (!plug162_write_advance(urb)) {
+            requeue[k++] = urb;
+            continue;
+        }
+        plug162_put_write_slot(dev, false);
+        plug162_release_write_buf(urb);
+        usb_put_urb(urb);
+    }
+
+    return k;
+}
+
+/*
+ * An urgent write waits for nothing but io_mutex, an SRCU grace period
+ * and the packet on the wire: the user writes queued ahead of it are
+ * stopped and go out again after it.
+ */
+static int plug162_submit_urgent(struct usb_plug162 *dev, struct urb *urb,
+                bool cancel)
+{
+    struct urb *requeue[WRITES_IN_FLIGHT];
+    int n;
+    int i;
+    int rv;
+
+    plug162_capture_urb(dev, PLUG162_CAPTURE_OUT, urb,
+            urb->transfer_buffer_length);
+
+    mutex_lock(&dev->io_mutex);
+    if (dev->interface == NULL) {
+        rv = -ENODEV;
+        goto exit;
+    }
+    if (test_bit(PLUG162_HALT_OUT, &dev->recover_flags) || dev->quiesced) {
+        usb_anchor_urb(urb, &dev->parked_urgent);
+        rv = 0;
+        goto exit;
+    }
+
+    WRITE_ONCE(dev->preempting, true);
+    synchronize_srcu_expedited(&plug162_srcu);
+
+    n = plug162_preempt_writes(dev, cancel, requeue);
+    rv = plug162_anchor_and_submit(dev, urb);
+
+    for (i = 0; i < n; i++) {
+        int err;
+
+        /* a halt meanwhile: they belong behind the writes it parked */
+        if (test_bit(PLUG162_HALT_OUT, &dev->recover_flags)) {
+            usb_anchor_urb(requeue[i], &dev->halted);
+        } else {
+            err = plug162_anchor_and_submit(dev, requeue[i]);
+            if (err < 0) {
+                plug162_put_write_slot(dev, false);
+                plug162_release_write_buf(requeue[i]);
+                atomic_set(&dev->errors, err);
+            }
+        }
+        usb_put_urb(requeue[i]);
+    }
+    WRITE_ONCE(dev->preempting, false);
+
+exit:
+    mutex_unlock(&dev->io_mutex);
+
+    return rv;
+}
+
+/*
+ * A write is sent as consecutive int_out_size packets, so one call can
+ * carry a whole batch of commands. The call returns once the urb is
+ * submitted; use poll() for a free slot and fsync() to know that the
+ * transfer, and with it any pinned user buffer, has completed.
+ *
+ * Files set to PLUG162_PRIO_URGENT write one packet at a time from a
+ * slot of their own, ahead of the other writes, see plug162_submit_urgent.
+ */
+static ssize_t plug162_write(struct file *file, const char *user_buf, 
+                size_t count, loff_t *ppos)
+{
+    struct plug162_file *pf;
+    struct usb_plug162 *dev;
+    struct plug162_write *w;
+    struct urb *urb = NULL;
+    size_t write_size;
+    u32 priority;
+    bool urgent;
+    int rv = 0;
+
+    pf = file->private_data;
+    dev = pf->dev;
+    priority = READ_ONCE(pf->priority);
+    urgent = priority & PLUG162_PRIO_URGENT;
+    write_size = min_t(size_t, count,
+            urgent ? dev->int_out_size : PLUG162_MAX_WRITE);
+    
+    if (count == 0)
+        goto exit;
+
+    rv = plug162_take_write_slot(dev, urgent, file->f_flags & O_NONBLOCK);
+    if (rv < 0)
+        goto exit;
+
+    rv = plug162_take_error(dev);
+    if (rv < 0)
+        goto error;
+
+    urb = usb_alloc_urb(0, GFP_KERNEL);
+    if (urb == NULL) {
+        rv = -ENOMEM;
+        goto error;
+    }
+    
+    if (plug162_can_pin(dev, user_buf, write_size))
+        rv = plug162_fill_pinned_urb(dev, urb, user_buf, write_size);
+    else
+        rv = plug162_fill_copied_urb(dev, urb, user_buf, write_size);
+    if (rv < 0)
+        goto error_free;
+
+    w = urb->context;
+    __set_bit(PLUG162_WRITE_USER, &w->flags);
+    if (urgent) {
+        __set_bit(PLUG162_WRITE_URGENT, &w->flags);
+        rv = plug162_submit_urgent(dev, urb,
+                priority & PLUG162_PRIO_CANCEL);
+    } else {
+        rv = plug162_submit_write(dev, urb);
+    }
+    if (rv < 0) {
+        if (rv != -ENODEV)
+            printk(KERN_ERR "%s - failed submitting write urb, error %d",
+                    __func__, rv);
+        goto error_release;
+    }
+
+    usb_free_urb(urb);
+
+    return write_size;
+
+error_release:
+    plug162_release_write_buf(urb);
+
+error_free:
+    usb_free_urb(urb);
+
+error:
+    plug162_put_write_slot(dev, urgent);
+exit:
+    return rv;
+}
+
+static __poll_t plug162_poll(struct file *file, poll_table *wait)
+{
+    struct plug162_file *pf;
+    struct usb_plug162 *dev;
+    __poll_t mask = 0;
+
+    pf = file->private_data;
+    dev = pf->dev;
+    poll_wait(file, &pf->wait, wait);
+    poll_wait(file, &dev->write_wait, wait);
+
+    if (READ_ONCE(dev->gone))
+        mask |= EPOLLHUP | EPOLLERR;
+    if (atomic_read(&dev->errors) || READ_ONCE(dev->in_error))
+        mask |= EPOLLERR;
+    if (plug162_file_ready(dev, pf))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (READ_ONCE(pf->priority) & PLUG162_PRIO_URGENT) {
+        if (atomic_read(&dev->urgent_in_flight) < PLUG162_URGENT_WRITES)
+            mask |= EPOLLOUT | EPOLLWRNORM;
+    } else if (atomic_read(&dev->writes_in_flight) -
+            atomic_read(&dev->urgent_in_flight) < WRITES_IN_FLIGHT) {
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    }
+
+    return mask;
+}
+
+static int plug162_fsync(struct file *file, loff_t start, loff_t end,
+                int datasync)
+{
+    struct plug162_file *pf;
+    struct usb_plug162 *dev;
+    int rv;
+
+    pf = file->private_data;
+    dev = pf->dev;
+
+    /* completed urbs have dropped their bounce buffers and pinned pages */
+    rv = wait_event_interruptible_timeout(dev->write_wait,
+            !atomic_read(&dev->writes_in_flight),
+            msecs_to_jiffies(PLUG162_FSYNC_TIMEOUT));
+    if (rv < 0)
+        return rv;
+    if (!rv)
+        return -ETIMEDOUT;
+
+    return plug162_take_error(dev);
+}
+
+
+static void plug162_discard_anchor(struct usb_plug162 *dev,
+                struct usb_anchor *anchor)
+{
+    struct urb *urb;
+
+    while ((urb = usb_get_from_anchor(anchor))) {
+        plug162_put_write_slot(dev, plug162_urb_urgent(urb));
+        plug162_release_write_buf(urb);
+        usb_free_urb(urb);
+    }
+}
+
+static void plug162_resubmit_anchor(struct usb_plug162 *dev,
+                struct usb_anchor *anchor)
+{
+    struct urb *urb;
+    int rv;
+
+    while ((urb = usb_get_from_anchor(anchor))) {
+        /* a halted urb may have sent some packets already */
+        if (plug162_write_advance(urb)) {
+            plug162_put_write_slot(dev, plug162_urb_urgent(urb));
+            plug162_release_write_buf(urb);
+            usb_free_urb(urb);
+            continue;
+        }
+        usb_anchor_urb(urb, &dev->submitted);
+        rv = usb_submit_urb(urb, GFP_KERNEL);
+        if (rv < 0) {
+            usb_unanchor_urb(urb);
+            plug162_put_write_slot(dev, plug162_urb_urgent(urb));
+            plug162_release_write_buf(urb);
+            atomic_set(&dev->errors, rv);
+        } else {
+            dev->recover_stats.resubmits++;
+        }
+        usb_free_urb(urb);
+    }
+}
+
+/* called with io_mutex held once the endpoints are usable again */
+static void plug162_resume_io(struct usb_plug162 *dev)
+{
+    int rv;
+
+    /*
+     * Parked writes must not overtake ones still queued at the host
+     * controller. Those left past the drain are dropped, and reported.
+     */
+    if (!usb_wait_anchor_empty_timeout(&dev->submitted,
+            PLUG162_RECOVER_DRAIN_MS)) {
+        usb_kill_anchored_urbs(&dev->submitted);
+        atomic_set(&dev->errors, -EIO);
+    }
+
+    plug162_resubmit_anchor(dev, &dev->parked_urgent);
+    plug162_resubmit_anchor(dev, &dev->halted);
+    plug162_resubmit_anchor(dev, &dev->deferred);
+    clear_bit(PLUG162_HALT_OUT, &dev->recover_flags);
+
+    if (test_and_clear_bit(PLUG162_HALT_IN, &dev->recover_flags) ||
+        dev->in_reset) {
+        if (!dev->ongoing_read)
+            return;
+        rv = usb_submit_urb(dev->int_in_urb, GFP_NOIO);
+        if (rv < 0)
+            plug162_fail_reads(dev, rv);
+    }
+}
+
+static void plug162_recover_give_up(struct usb_plug162 *dev)
+{
+    dev_warn(&dev->interface->dev, "endpoint recovery failed, giving up\n");
+    trace_plug162_recovery(dev->minor, PLUG162_RECOVER_GIVE_UP, -EIO,
+            dev->recover_attempts);
+    dev->recover_stats.failures++;
+    dev->recover_attempts = 0;
+
+    plug162_discard_anchor(dev, &dev->parked_urgent);
+    plug162_discard_anchor(dev, &dev->halted);
+    plug162_discard_anchor(dev, &dev->deferred);
+    clear_bit(PLUG162_HALT_OUT, &dev->recover_flags);
+
+    atomic_set(&dev->errors, -EIO);
+
+    if (test_and_clear_bit(PLUG162_HALT_IN, &dev->recover_flags))
+        plug162_fail_reads(dev, -EIO);
+}
+
+static void plug162_recover_work(struct work_struct *work)
+{
+    struct usb_plug162 *dev;
+    int rv = 0;
+
+    dev = container_of(to_delayed_work(work), struct usb_plug162,
+            recover_work);
+
+    /* let writes queued behind the stalled one fail and park as well */
+    usb_wait_anchor_empty_timeout(&dev->submitted, PLUG162_RECOVER_DRAIN_MS);
+
+    mutex_lock(&dev->io_mutex);
+    if (dev->interface == NULL)
+        goto exit;
+
+    dev->recover_stats.runs++;
+    if (++dev->recover_attempts > PLUG162_RECOVER_MAX_TRIES) {
+        plug162_recover_give_up(dev);
+        goto exit;
+    }
+
+    if (dev->recover_attempts > PLUG162_RECOVER_RESET_AFTER) {
+        trace_plug162_recovery(dev->minor, PLUG162_RECOVER_RESET, 0,
+                dev->recover_attempts);
+        dev->recover_stats.resets++;
+        /* plug162_post_reset() resubmits what is parked */
+        usb_queue_reset_device(dev->interface);
+        goto exit;
+    }
+
+    if (test_bit(PLUG162_HALT_OUT, &dev->recover_flags))
+        rv = usb_clear_halt(dev->udev,
+                usb_sndintpipe(dev->udev, dev->int_out_ep_addr));
+    if (!rv && test_bit(PLUG162_HALT_IN, &dev->recover_flags))
+        rv = usb_clear_halt(dev->udev,
+                usb_rcvintpipe(dev->udev, dev->int_in_ep_addr));
+    trace_plug162_recovery(dev->minor, PLUG162_RECOVER_CLEAR_HALT, rv,
+            dev->recover_attempts);
+    if (rv < 0) {
+        schedule_delayed_work(&dev->recover_work, plug162_recover_delay(dev));
+        goto exit;
+    }
+
+    dev->recover_stats.halts_cleared++;
+    plug162_resume_io(dev);
+    trace_plug162_recovery(dev->minor, PLUG162_RECOVER_RESUBMIT, 0,
+            dev->recover_attempts);
+
+exit:
+    mutex_unlock(&dev->io_mutex);
+}
+
+#define PLUG162_RECOVER_ATTR(_name)                                     \
+static ssize_t recovery_##_name##_show(struct device *d,                \
+                struct device_attribute *attr, char *buf)               \
+{                                                                       \
+    struct usb_plug162 *dev = dev_get_drvdata(d);                       \
+                                                                        \
+    return sysfs_emit(buf, "%lu\n", dev->recover_stats._name);          \
+}                                                                       \
+static DEVICE_ATTR_RO(recovery_##_name)
+
+PLUG162_RECOVER_ATTR(runs);
+PLUG162_RECOVER_ATTR(halts_cleared);
+PLUG162_RECOVER_ATTR(resets);
+PLUG162_RECOVER_ATTR(resubmits);
+PLUG162_RECOVER_ATTR(failures);
+
+static ssize_t num_leds_show(struct device *d,
+                struct device_attribute *attr, char *buf)
+{
+    struct usb_plug162 *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%u\n", dev->num_leds);
+}
+static DEVICE_ATTR_RO(num_leds);
+
+static ssize_t num_buttons_show(struct device *d,
+                struct device_attribute *attr, char *buf)
+{
+    struct usb_plug162 *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%u\n", dev->num_buttons);
+}
+static DEVICE_ATTR_RO(num_buttons);
+
+/* one value per button channel */
+#define PLUG162_CHANNEL_ATTR(_name)                                     \
+static ssize_t button_##_name##_show(struct device *d,                  \
+                struct device_attribute *attr, char *buf)               \
+{                                                                       \
+    struct usb_plug162 *dev = dev_get_drvdata(d);                       \
+    int len = 0;                                                        \
+    int i;                                                              \
+                                                                        \
+    for (i = 0; i < dev->num_buttons; i++)                              \
+        len += sysfs_emit_at(buf, len, "%s%lu", i ? " " : "",           \
+                dev->channels[i]._name);                                \
+    len += sysfs_emit_at(buf, len, "\n");                               \
+                                                                        \
+    return len;                                                         \
+}                                                                       \
+static DEVICE_ATTR_RO(button_##_name)
+
+PLUG162_CHANNEL_ATTR(presses);
+PLUG162_CHANNEL_ATTR(long_presses);
+PLUG162_CHANNEL_ATTR(double_presses);
+
+static ssize_t events_dropped_show(struct device *d,
+                struct device_attribute *attr, char *buf)
+{
+    struct usb_plug162 *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%lu\n", dev->events_dropped);
+}
+static DEVICE_ATTR_RO(events_dropped);
+
+static ssize_t writes_cancelled_show(struct device *d,
+                struct device_attribute *attr, char *buf)
+{
+    struct usb_plug162 *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%ld\n", atomic_long_read(&dev->writes_cancelled));
+}
+static DEVICE_ATTR_RO(writes_cancelled);
+
+static ssize_t probe_us_show(struct device *d,
+                struct device_attribute *attr, char *buf)
+{
+    struct usb_plug162 *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%lld\n", dev->probe_us);
+}
+static DEVICE_ATTR_RO(probe_us);
+
+/* 0 until the PING sent by probe, or anything else, has gone through */
+static ssize_t first_urb_us_show(struct device *d,
+                struct device_attribute *attr, char *buf)
+{
+    struct usb_plug162 *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%lld\n", atomic64_read(&dev->first_urb_us));
+}
+static DEVICE_ATTR_RO(first_urb_us);
+
+/* 0 when the firmware does not report it */
+static ssize_t device_ready_ms_show(struct device *d,
+                struct device_attribute *attr, char *buf)
+{
+    struct usb_plug162 *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%u\n", dev->device_ready_ms);
+}
+static DEVICE_ATTR_RO(device_ready_ms);
+
+/* asks the device, so it is right even after another host changed it */
+static ssize_t led_state_show(struct device *d,
+                struct device_attribute *attr, char *buf)
+{
+    struct usb_interface *intf = to_usb_interface(d);
+    struct usb_plug162 *dev = dev_get_drvdata(d);
+    u8 status[2];
+    int rv;
+
+    rv = usb_autopm_get_interface(intf);
+    if (rv < 0)
+        return rv;
+    rv = usb_control_msg_recv(dev->udev, 0, REQ_GET_STATUS,
+            USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_INTERFACE, 0,
+            intf->cur_altsetting->desc.bInterfaceNumber,
+            status, sizeof(status), USB_CTRL_GET_TIMEOUT, GFP_KERNEL);
+    usb_autopm_put_interface(intf);
+    if (rv < 0)
+        return rv;
+
+    return sysfs_emit(buf, "0x%02x\n", status[0]);
+}
+static DEVICE_ATTR_RO(led_state);
+
+static int plug162_read_telemetry(struct device *d, u16 flags,
+                struct plug162_telemetry_desc *t)
+{
+    struct usb_interface *intf = to_usb_interface(d);
+    struct usb_plug162 *dev = dev_get_drvdata(d);
+    int rv;
+
+    rv = usb_autopm_get_interface(intf);
+    if (rv < 0)
+        return rv;
+    rv = usb_control_msg_recv(dev->udev, 0, REQ_GET_TELEMETRY,
+            USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_INTERFACE, flags,
+            intf->cur_altsetting->desc.bInterfaceNumber,
+            t, sizeof(*t), USB_CTRL_GET_TIMEOUT, GFP_KERNEL);
+    usb_autopm_put_interface(intf);
+    if (rv < 0)
+        return rv;
+    if (t->bLength < sizeof(*t))
+        return -EPROTO;
 
-    file->private_data = dev;
-    mutex_unlock(&dev->io_mutex);
+    return 0;
+}
 
-exit:
-    return ret;
+/*
+ * Counters kept by the firmware, read from the device each time. They
+ * live in their own directory, so may share names with the driver's.
+ */
+#define PLUG162_TELEMETRY_ATTR(_name, _field, _conv)                    \
+static ssize_t telemetry_##_name##_show(struct device *d,               \
+                struct device_attribute *attr, char *buf)               \
+{                                                                       \
+    struct plug162_telemetry_desc t;                                    \
+    int rv;                                                             \
+                                                                        \
+    rv = plug162_read_telemetry(d, 0, &t);                              \
+    if (rv < 0)                                                         \
+        return rv;                                                      \
+                                                                        \
+    return sysfs_emit(buf, "%u\n", _conv(t._field));                    \
+}                                                                       \
+static struct device_attribute telemetry_attr_##_name =                 \
+    __ATTR(_name, 0444, telemetry_##_name##_show, NULL)
+
+PLUG162_TELEMETRY_ATTR(loops, dLoops, le32_to_cpu);
+PLUG162_TELEMETRY_ATTR(sofs, dSofs, le32_to_cpu);
+PLUG162_TELEMETRY_ATTR(in_aborted, wInAborted, le16_to_cpu);
+PLUG162_TELEMETRY_ATTR(unknown_opcodes, wUnknownOps, le16_to_cpu);
+PLUG162_TELEMETRY_ATTR(button_edges, wButtonEdges, le16_to_cpu);
+PLUG162_TELEMETRY_ATTR(events_dropped, wEventsDropped, le16_to_cpu);
+
+static ssize_t ping_interval_ms_show(struct device *d,
+                struct device_attribute *attr, char *buf)
+{
+    struct usb_plug162 *dev = dev_get_drvdata(d);
+
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev->ping_interval_ms));
 }
 
-static int plug162_release(struct inode *inode, struct file *file)
+/* 0 stops pinging */
+static ssize_t ping_interval_ms_store(struct device *d,
+                struct device_attribute *attr, const char *buf, size_t count)
 {
-    struct usb_plug162 *dev;
+    struct usb_plug162 *dev = dev_get_drvdata(d);
+    unsigned int ms;
+    int rv;
 
-    dev = file->private_data;
-    if (dev == NULL)
-        return -ENODEV;
-    
-    /* allow the device to be autosuspended */
+    rv = kstrtouint(buf, 0, &ms);
+    if (rv < 0)
+        return rv;
+    if (ms && ms < PLUG162_PING_MIN_INTERVAL)
+        return -EINVAL;
+
+    WRITE_ONCE(dev->ping_interval_ms, ms);
     mutex_lock(&dev->io_mutex);
-    if (!--dev->open_count && dev->interface)
-        usb_autopm_put_interface(dev->interface);
+    if (dev->interface && dev->ongoing_read)
+        plug162_start_pinging(dev);
     mutex_unlock(&dev->io_mutex);
 
-    /* decrement the count on our device */
-    kref_put(&dev->kref, plug162_delete);
-    
-    return 0;
+    return count;
 }
+static DEVICE_ATTR_RW(ping_interval_ms);
 
-static int plug162_flush(struct file *file, fl_owner_t id)
+/* a copy, so percentiles are taken over one consistent histogram */
+static void plug162_rtt_snapshot(struct usb_plug162 *dev,
+                struct plug162_rtt *rtt)
 {
-    return 0;
+    spin_lock_irq(&dev->rtt_lock);
+    *rtt = dev->rtt;
+    spin_unlock_irq(&dev->rtt_lock);
 }
 
-static void plug162_read_int_callback(struct urb *urb)
+/* the upper end of the bucket holding the @pct percentile */
+static u32 plug162_rtt_percentile(const struct plug162_rtt *rtt,
+                unsigned int pct)
 {
-    struct usb_plug162 *dev;
-    
-    dev = urb->context;
-    spin_lock(&dev->err_lock);
-    /* sync/async unlink faults aren't errors */
-    if (urb->status) {
-        if (!(urb->status == -ENOENT ||
-            urb->status == -ECONNRESET ||
-            urb->status == -ESHUTDOWN)) {
-            printk(KERN_DEBUG "%s - nonzero write int status received: %d",
-                __func__, urb->status);
-            spin_lock(&dev->err_lock);
-            dev->errors = urb->status;
-            spin_unlock(&dev->err_lock);
-        }
-        dev->int_in_filled = 0;
-    } else {
-        dev->int_in_filled = urb->actual_length;
+    u64 want = div_u64(rtt->count * pct + 99, 100);
+    u64 seen = 0;
+    int i;
+
+    if (!rtt->count)
+        return 0;
+
+    for (i = 0; i < PLUG162_RTT_BUCKETS - 1; i++) {
+        seen += rtt->buckets[i];
+        if (seen >= want)
+            break;
     }
-    spin_unlock(&dev->err_lock);
-    complete(&dev->int_in_completion);
+    if (i == PLUG162_RTT_BUCKETS - 1)
+        return rtt->max_us;
+
+    return clamp_t(u32, (2U << i) - 1, rtt->min_us, rtt->max_us);
+}
+
+#define PLUG162_RTT_ATTR(_name, _fmt, _expr)                            \
+static ssize_t rtt_##_name##_show(struct device *d,                     \
+                struct device_attribute *attr, char *buf)               \
+{                                                                       \
+    struct usb_plug162 *dev = dev_get_drvdata(d);                       \
+    struct plug162_rtt rtt;                                             \
+                                                                        \
+    plug162_rtt_snapshot(dev, &rtt);                                    \
+                                                                        \
+    return sysfs_emit(buf, _fmt "\n", _expr);                           \
+}                                                                       \
+static struct device_attribute rtt_attr_##_name =                       \
+    __ATTR(_name, 0444, rtt_##_name##_show, NULL)
+
+PLUG162_RTT_ATTR(count, "%llu", rtt.count);
+PLUG162_RTT_ATTR(lost, "%llu", rtt.lost);
+PLUG162_RTT_ATTR(min_us, "%u", rtt.min_us);
+PLUG162_RTT_ATTR(max_us, "%u", rtt.max_us);
+PLUG162_RTT_ATTR(p50_us, "%u", plug162_rtt_percentile(&rtt, 50));
+PLUG162_RTT_ATTR(p90_us, "%u", plug162_rtt_percentile(&rtt, 90));
+PLUG162_RTT_ATTR(p99_us, "%u", plug162_rtt_percentile(&rtt, 99));
+
+/* bucket counts, from [1, 2) us up */
+static ssize_t rtt_histogram_show(struct device *d,
+                struct device_attribute *attr, char *buf)
+{
+    struct usb_plug162 *dev = dev_get_drvdata(d);
+    struct plug162_rtt rtt;
+    int len = 0;
+    int i;
+
+    plug162_rtt_snapshot(dev, &rtt);
+    for (i = 0; i < PLUG162_RTT_BUCKETS; i++)
+        len += sysfs_emit_at(buf, len, "%s%u", i ? " " : "", rtt.buckets[i]);
+    len += sysfs_emit_at(buf, len, "\n");
+
+    return len;
 }
+static struct device_attribute rtt_attr_histogram =
+    __ATTR(histogram, 0444, rtt_histogram_show, NULL);
 
-static int plug162_do_read_io(struct usb_plug162 *dev, size_t count)
+/* writing anything restarts the peak */
+static ssize_t telemetry_work_max_us_show(struct device *d,
+                struct device_attribute *attr, char *buf)
 {
+    struct plug162_telemetry_desc t;
     int rv;
 
-    rv = mutex_lock_interruptible(&dev->io_mutex);
+    rv = plug162_read_telemetry(d, 0, &t);
     if (rv < 0)
         return rv;
 
-    if (dev->interface == NULL) {
-        rv = -ENODEV;
-        goto exit;
-    }
+    return sysfs_emit(buf, "%u\n", le16_to_cpu(t.wWorkMaxUs));
+}
 
-    usb_fill_int_urb(dev->int_in_urb,
-            dev->udev,
-            usb_rcvintpipe(dev->udev,
-                dev->int_in_ep_addr),
-            dev->int_in_buf,
-            count,
-            plug162_read_int_callback,
-            dev, dev->int_in_ep_interval);
-    
-    rv = usb_submit_urb(dev->int_in_urb, GFP_KERNEL);
-    if (rv < 0) {
-        printk(KERN_ERR "%s - failed submitting read urb, error %d",
-            __func__, rv);
-        dev->int_in_filled = 0;
-        rv = (rv == -ENOMEM) ? rv : -EIO;
-    }
+static ssize_t telemetry_work_max_us_store(struct device *d,
+                struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct plug162_telemetry_desc t;
+    int rv;
 
-exit:
-    mutex_unlock(&dev->io_mutex);
+    rv = plug162_read_telemetry(d, TELEMETRY_CLEAR_MAX, &t);
 
-    return rv;
+    return rv < 0 ? rv : count;
 }
+static struct device_attribute telemetry_attr_work_max_us =
+    __ATTR(work_max_us, 0644, telemetry_work_max_us_show,
+            telemetry_work_max_us_store);
+
+static struct attribute *plug162_attrs[] = {
+    &dev_attr_num_leds.attr,
+    &dev_attr_num_buttons.attr,
+    &dev_attr_button_presses.attr,
+    &dev_attr_button_long_presses.attr,
+    &dev_attr_button_double_presses.attr,
+    &dev_attr_events_dropped.attr,
+    &dev_attr_writes_cancelled.attr,
+    &dev_attr_probe_us.attr,
+    &dev_attr_first_urb_us.attr,
+    &dev_attr_device_ready_ms.attr,
+    &dev_attr_ping_interval_ms.attr,
+    &dev_attr_led_state.attr,
+    &dev_attr_recovery_runs.attr,
+    &dev_attr_recovery_halts_cleared.attr,
+    &dev_attr_recovery_resets.attr,
+    &dev_attr_recovery_resubmits.attr,
+    &dev_attr_recovery_failures.attr,
+    NULL,
+};
 
+static struct attribute *plug162_telemetry_attrs[] = {
+    &telemetry_attr_work_max_us.attr,
+    &telemetry_attr_loops.attr,
+    &telemetry_attr_sofs.attr,
+    &telemetry_attr_in_aborted.attr,
+    &telemetry_attr_unknown_opcodes.attr,
+    &telemetry_attr_button_edges.attr,
+    &telemetry_attr_events_dropped.attr,
+    NULL,
+};
 
-static ssize_t plug162_read(struct file *file, char *buf, size_t count,
-                loff_t *ppos)
-{
-    
-    struct usb_plug162 *dev;
-    size_t copy_len;
-    int rv = 0;
-
-    dev = file->private_data;
-    if (!dev->int_in_urb)
-        return 0;
-    if (file->f_flags & O_NONBLOCK)
-        return -EPERM;
-    
-    rv = mutex_lock_interruptible(&dev->read_mutex);
-    if (rv < 0)
-        return rv;
-    
-    rv = plug162_do_read_io(dev, dev->int_in_size);
-    if (rv < 0) 
-        goto exit;
+static struct attribute *plug162_rtt_attrs[] = {
+    &rtt_attr_count.attr,
+    &rtt_attr_lost.attr,
+    &rtt_attr_min_us.attr,
+    &rtt_attr_max_us.attr,
+    &rtt_attr_p50_us.attr,
+    &rtt_attr_p90_us.attr,
+    &rtt_attr_p99_us.attr,
+    &rtt_attr_histogram.attr,
+    NULL,
+};
 
-    rv = wait_for_completion_interruptible(&dev->int_in_completion);
-    if (rv < 0) {
-        printk(KERN_DEBUG "Wait for completion interrupted");
-        mutex_lock(&dev->io_mutex);
-        if (dev->interface != NULL)
-            usb_kill_urb(dev->int_in_urb);
-        mutex_unlock(&dev->io_mutex);
-        init_completion(&dev->int_in_completion);
-        goto exit;
-    }
+static const struct attribute_group plug162_group = {
+    .attrs = plug162_attrs,
+};
 
-    copy_len = min(count, dev->int_in_filled);
-    if (copy_to_user(buf, dev->int_in_buf, copy_len))
-        rv = -EFAULT;
-    else
-        rv = copy_len;
+/* the device's view, in telemetry/ */
+static const struct attribute_group plug162_telemetry_group = {
+    .name = "telemetry",
+    .attrs = plug162_telemetry_attrs,
+};
 
-exit:
-    mutex_unlock(&dev->read_mutex);
+/* PING round trips, in rtt/ */
+static const struct attribute_group plug162_rtt_group = {
+    .name = "rtt",
+    .attrs = plug162_rtt_attrs,
+};
 
-    return rv;
-}
+static const struct attribute_group *plug162_groups[] = {
+    &plug162_group,
+    &plug162_telemetry_group,
+    &plug162_rtt_group,
+    NULL,
+};
 
-static void plug162_write_int_callback(struct urb *urb)
+static long plug162_ioctl(struct file *file, unsigned int cmd,
+                unsigned long arg)
 {
+    struct plug162_file *pf;
     struct usb_plug162 *dev;
-
-    dev = urb->context;
-
-    if (urb->status) {
-        if (!(urb->status == -ENOENT ||
-            urb->status == -ECONNRESET || 
-            urb->status == -ESHUTDOWN)) {
-            printk(KERN_DEBUG "%s - nonzero write int status received: %d",
-                    __func__, urb->status);
-            spin_lock(&dev->err_lock);
-            dev->errors = urb->status;
-            spin_unlock(&dev->err_lock);
-        }
-
+    void __user *argp = (void __user *)arg;
+    struct plug162_caps caps;
+    struct plug162_gesture gesture;
+    struct plug162_moderation mod;
+    u8 packet[7];
+    __u32 mask;
+
+    pf = file->private_data;
+    dev = pf->dev;
+
+    switch (cmd) {
+    case PLUG162_IOC_GET_CAPS:
+        memset(&caps, 0, sizeof(caps));
+        caps.version = dev->caps_version;
+        caps.num_leds = dev->num_leds;
+        caps.num_buttons = dev->num_buttons;
+        if (copy_to_user(argp, &caps, sizeof(caps)))
+            return -EFAULT;
+        return 0;
+    case PLUG162_IOC_SET_CHANNELS:
+        if (get_user(mask, (__u32 __user *)argp))
+            return -EFAULT;
+        WRITE_ONCE(pf->channels, mask);
+        /* events on the new channels may already be waiting */
+        wake_up_interruptible(&pf->wait);
+        return 0;
+    case PLUG162_IOC_SET_MODERATION:
+        if (copy_from_user(&mod, argp, sizeof(mod)))
+            return -EFAULT;
+        if (mod.batch_events > PLUG162_EVENT_QUEUE_LEN ||
+            mod.max_latency_us > PLUG162_MAX_LATENCY_US)
+            return -EINVAL;
+        /* the callback takes files_lock, so cancel outside it */
+        hrtimer_cancel(&pf->timer);
+        spin_lock_irq(&dev->files_lock);
+        pf->batch = mod.batch_events;
+        pf->max_latency_us = mod.max_latency_us;
+        /* the old deadline no longer applies; what waits is due now */
+        WRITE_ONCE(pf->due, plug162_pending(dev, pf) != 0);
+        spin_unlock_irq(&dev->files_lock);
+        wake_up_interruptible(&pf->wait);
+        return 0;
+    case PLUG162_IOC_GET_MODERATION:
+        memset(&mod, 0, sizeof(mod));
+        mod.batch_events = READ_ONCE(pf->batch);
+        mod.max_latency_us = READ_ONCE(pf->max_latency_us);
+        if (copy_to_user(argp, &mod, sizeof(mod)))
+            return -EFAULT;
+        return 0;
+    case PLUG162_IOC_SET_GESTURE:
+        if (copy_from_user(&gesture, argp, sizeof(gesture)))
+            return -EFAULT;
+        packet[0] = GESTURE_CONFIG;
+        packet[1] = gesture.debounce_ms & 0xff;
+        packet[2] = gesture.debounce_ms >> 8;
+        packet[3] = gesture.long_press_ms & 0xff;
+        packet[4] = gesture.long_press_ms >> 8;
+        packet[5] = gesture.double_gap_ms & 0xff;
+        packet[6] = gesture.double_gap_ms >> 8;
+        return plug162_send_command(dev, packet, sizeof(packet), false);
+    case PLUG162_IOC_SET_PRIORITY:
+        if (get_user(mask, (__u32 __user *)argp))
+            return -EFAULT;
+        if (mask & ~(PLUG162_PRIO_URGENT | PLUG162_PRIO_CANCEL) ||
+            mask == PLUG162_PRIO_CANCEL)
+            return -EINVAL;
+        WRITE_ONCE(pf->priority, mask);
+        /* poll() now looks at the other lane's slots */
+        wake_up_interruptible(&dev->write_wait);
+        return 0;
+    case PLUG162_IOC_GET_PRIORITY:
+        return put_user(READ_ONCE(pf->priority), (__u32 __user *)argp);
+    default:
+        return -ENOTTY;
     }
-    
-    kfree(urb->transfer_buffer);
-    up(&dev->limit_sem);
 }
 
+static const struct file_operations plug162_fops = {
+    .owner =    THIS_MODULE,
+    .read =     plug162_read,
+    .write =    plug162_write,
+    .open =     plug162_open,
+    .release =  plug162_release,
+    .flush =    plug162_flush,
+    .poll =     plug162_poll,
+    .fsync =    plug162_fsync,
+    .unlocked_ioctl = plug162_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .llseek =   noop_llseek,
+};
+
+static struct dentry *plug162_debugfs_root;
 
-static ssize_t plug162_write(struct file *file, const char *user_buf, 
+/*
+ * Drains whole records, after the file header on the first read. Returns
+ * 0 once the ring is empty, so a reader polls it for a live capture.
+ */
+static ssize_t plug162_capture_read(struct file *file, char __user *ubuf,
                 size_t count, loff_t *ppos)
 {
-    struct usb_plug162 *dev;
-    struct urb *urb = NULL;
-    unsigned char *buf = NULL;
-    size_t write_size;
-    int rv = 0;
+    const size_t max = sizeof(struct plug162_capture_record) +
+            PLUG162_MAX_WRITE;
+    struct usb_plug162 *dev = file->private_data;
+    struct plug162_capture_header hdr = {
+        .magic = PLUG162_CAPTURE_MAGIC,
+        .version = PLUG162_CAPTURE_VERSION,
+        .record_size = sizeof(struct plug162_capture_record),
+    };
+    struct plug162_capture_record rec;
+    size_t len = 0;
+    u8 *buf;
+    int rv;
 
-    dev = file->private_data;
-    write_size = min(count, dev->int_out_size);
-    
-    if (count == 0)
-        goto exit;
+    buf = kmalloc(max, GFP_KERNEL);
+    if (buf == NULL)
+        return -ENOMEM;
 
-    if (!(file->f_flags & O_NONBLOCK)) {
-        if (down_interruptible(&dev->limit_sem)) {
-            rv = -ERESTARTSYS;
-            goto exit;
-        }
-    } else {
-        if (down_trylock(&dev->limit_sem)) {
-            rv = -EAGAIN;
+    if (*ppos == 0) {
+        if (count < sizeof(hdr)) {
+            rv = -EINVAL;
             goto exit;
         }
+        memcpy(buf, &hdr, sizeof(hdr));
+        len = sizeof(hdr);
     }
 
-    spin_lock_irq(&dev->err_lock);
-    rv = dev->errors;
-    if (rv < 0) {
-        dev->errors = 0;
-        rv = (rv == -EPIPE) ? rv : -EIO;
-    }
-    spin_unlock_irq(&dev->err_lock);
-    if (rv < 0)
-        goto error;
+    spin_lock_irq(&dev->capture_lock);
+    while (kfifo_out_peek(&dev->capture, (u8 *)&rec, sizeof(rec)) ==
+            sizeof(rec)) {
+        size_t n = sizeof(rec) + rec.len;
 
-    urb = usb_alloc_urb(0, GFP_KERNEL);
-    if (urb == NULL) {
-        rv = -ENOMEM;
-        goto error;
+        if (len + n > min(count, max))
+            break;
+        len += kfifo_out(&dev->capture, buf + len, n);
     }
-    
-    buf = kmalloc(write_size, GFP_KERNEL);
-    if (urb == NULL) {
-        rv = -ENOMEM;
-        goto error;
+    spin_unlock_irq(&dev->capture_lock);
+
+    if (len == 0 && kfifo_len(&dev->capture)) {
+        /* too small for the next record */
+        rv = -EINVAL;
+        goto exit;
     }
 
-    if (copy_from_user(buf, user_buf, write_size)) {
+    rv = len;
+    if (copy_to_user(ubuf, buf, len))
         rv = -EFAULT;
-        goto error;
-    }
+    else
+        *ppos += len;
 
-    mutex_lock(&dev->io_mutex);
-    if (dev->interface == NULL) {
-        mutex_unlock(&dev->io_mutex);
-        rv = -ENODEV;
-        goto error;
-    }
-    
-    usb_fill_int_urb(urb, dev->udev,
-                usb_sndintpipe(dev->udev, dev->int_out_ep_addr),
-                buf, write_size, plug162_write_int_callback, dev,
-                dev->int_out_ep_interval);
-    usb_anchor_urb(urb, &dev->submitted);
+exit:
+    kfree(buf);
 
-    rv = usb_submit_urb(urb, GFP_KERNEL);
-    mutex_unlock(&dev->io_mutex);
-    if (rv < 0) {
-        printk(KERN_ERR "%s - failed submitting write urb, error %d",
-                __func__, rv);
-        goto error_unanchor;
-    }
+    return rv;
+}
 
-    usb_free_urb(urb);
+static const struct file_operations plug162_capture_fops = {
+    .owner =    THIS_MODULE,
+    .open =     simple_open,
+    .read =     plug162_capture_read,
+    .llseek =   noop_llseek,
+};
 
-    return write_size;
+static void plug162_debugfs_init(struct usb_plug162 *dev)
+{
+    char name[16];
 
-error_unanchor:
-    usb_unanchor_urb(urb);
+    snprintf(name, sizeof(name), "plug162%d", dev->minor);
+    dev->debugfs = debugfs_create_dir(name, plug162_debugfs_root);
 
-error:
-    printk(KERN_DEBUG "ERROR");
-    if (urb) {
-        kfree(buf);
-        usb_free_urb(urb);
+    if (!capture_kb)
+        return;
+    if (kfifo_alloc(&dev->capture, capture_kb * 1024, GFP_KERNEL)) {
+        dev_warn(&dev->interface->dev, "no memory for the capture ring\n");
+        return;
     }
-    
-    up(&dev->limit_sem);
-exit:
-    return rv;
+    debugfs_create_file("capture", 0400, dev->debugfs, dev,
+            &plug162_capture_fops);
+    debugfs_create_u32("capture_lost", 0400, dev->debugfs,
+            &dev->capture_lost);
 }
 
+/* for udev rules, see udev/60-plug162.rules */
+static ssize_t serial_show(struct device *d,
+                struct device_attribute *attr, char *buf)
+{
+    struct usb_plug162 *dev = dev_get_drvdata(d);
 
-static const struct file_operations plug162_fops = {
-    .owner =    THIS_MODULE,
-    .read =     plug162_read,
-    .write =    plug162_write,
-    .open =     plug162_open,
-    .release =  plug162_release,
-    .flush =    plug162_flush,
-    .llseek =   noop_llseek,
+    return sysfs_emit(buf, "%s\n", dev->udev->serial ?: "");
+}
+static DEVICE_ATTR_RO(serial);
+
+static struct attribute *plug162_node_attrs[] = {
+    &dev_attr_serial.attr,
+    NULL,
 };
+ATTRIBUTE_GROUPS(plug162_node);
 
-static struct usb_class_driver plug162_class = {
-    .name =     "plug162%d",
-    .fops =     &plug162_fops,
-    .minor_base =   USB_SKEL_MINOR_BASE,
+static const struct class plug162_class = {
+    .name =     "plug162",
+    .dev_groups =   plug162_node_groups,
 };
 
+/*
+ * Reads into int_in_buf, not yet submitted. Firmware without a caps
+ * descriptor stalls: one LED and button. v1 descriptors are shorter.
+ */
+static void plug162_read_caps(struct usb_plug162 *dev,
+                struct usb_interface *interface)
+{
+    const int v1_len = offsetofend(struct plug162_caps_desc, bNumButtons);
+    struct plug162_caps_desc caps = { };
+    int rv;
+
+    dev->num_leds = 1;
+    dev->num_buttons = 1;
+
+    rv = usb_control_msg(dev->udev, usb_rcvctrlpipe(dev->udev, 0),
+            REQ_GET_CAPS,
+            USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_INTERFACE, 0,
+            interface->cur_altsetting->desc.bInterfaceNumber,
+            dev->int_in_buf, min(dev->int_in_size, sizeof(caps)),
+            USB_CTRL_GET_TIMEOUT);
+    if (rv >= 0)
+        memcpy(&caps, dev->int_in_buf, rv);
+    if (rv < v1_len || caps.bLength < v1_len) {
+        dev_info(&interface->dev, "no capability descriptor, one channel\n");
+        return;
+    }
+
+    dev->caps_version = caps.bVersion;
+    dev->num_leds = clamp_t(u8, caps.bNumLeds, 1, MAX_CHANNELS);
+    dev->num_buttons = clamp_t(u8, caps.bNumButtons, 1, MAX_CHANNELS);
+    if (rv >= (int)sizeof(caps) && caps.bLength >= sizeof(caps))
+        dev->device_ready_ms = le16_to_cpu(caps.wReadyMs);
+}
+
 static int plug162_probe(struct usb_interface *interface, 
                 const struct usb_device_id *id)
 {
     struct usb_plug162 *dev;
-    struct usb_host_interface *iface_desc;
-    struct usb_endpoint_descriptor *ep;
+    struct usb_endpoint_descriptor *int_in, *int_out;
+    ktime_t start = ktime_get();
+    u8 ping[2] = { PING };
     int i;
     int ret = -ENOMEM;
 
@@ -392,62 +2187,108 @@ static int plug162_probe(struct usb_interface *interface,
         goto error;
     }
     kref_init(&dev->kref);
+    dev->probe_start = start;
     sema_init(&dev->limit_sem, WRITES_IN_FLIGHT);
+    sema_init(&dev->urgent_sem, PLUG162_URGENT_WRITES);
     mutex_init(&dev->read_mutex);
     mutex_init(&dev->io_mutex);
-    spin_lock_init(&dev->err_lock);
     init_usb_anchor(&dev->submitted);
-    init_completion(&dev->int_in_completion);
+    init_usb_anchor(&dev->halted);
+    init_usb_anchor(&dev->deferred);
+    init_usb_anchor(&dev->parked_urgent);
+    INIT_DELAYED_WORK(&dev->recover_work, plug162_recover_work);
+    INIT_DELAYED_WORK(&dev->ping_work, plug162_ping_work);
+    dev->ping_interval_ms = PLUG162_PING_INTERVAL;
+    spin_lock_init(&dev->rtt_lock);
+    INIT_LIST_HEAD(&dev->files);
+    spin_lock_init(&dev->files_lock);
+    init_waitqueue_head(&dev->write_wait);
+    spin_lock_init(&dev->capture_lock);
+    for (i = 0; i < MAX_CHANNELS; i++)
+        INIT_KFIFO(dev->channels[i].events);
 
     dev->udev = usb_get_dev(interface_to_usbdev(interface));
     dev->interface = interface;
 
-    iface_desc = interface->cur_altsetting;
-    for (i = 0; i < iface_desc->desc.bNumEndpoints; i++) {
-        ep = &iface_desc->endpoint[i].desc;
-
-        if (!dev->int_in_ep_addr && usb_endpoint_is_int_in(ep)) {
-            dev->int_in_ep_addr = ep->bEndpointAddress;
-            dev->int_in_ep_interval = ep->bInterval;
-            dev->int_in_size = usb_endpoint_maxp(ep);
-            dev->int_in_buf = kmalloc(dev->int_in_size, GFP_KERNEL);
-            if (dev->int_in_buf == NULL) {
-                printk(KERN_ERR "Could not allocate int_in_buf");
-                goto error;
-            }
-            dev->int_in_urb = usb_alloc_urb(0, GFP_KERNEL);
-            if (dev->int_in_urb == NULL) {
-                printk(KERN_ERR "Could not allocate int_in_urb\n");
-                goto error;
-            }
-        }
-
-        if (!dev->int_out_ep_addr && 
-            usb_endpoint_is_int_out(ep)) {
-            dev->int_out_size = usb_endpoint_maxp(ep);
-            dev->int_out_ep_addr = ep->bEndpointAddress;
-            dev->int_out_ep_interval = ep->bInterval;
-        }
-    }
-    if (!(dev->int_in_ep_addr && dev->int_out_ep_addr)) {
+    ret = usb_find_common_endpoints(interface->cur_altsetting,
+            NULL, NULL, &int_in, &int_out);
+    if (ret) {
         printk(KERN_DEBUG "Could not find both int-in and int-out endpoints\n");
         goto error;
     }
+    dev->int_in_ep_addr = int_in->bEndpointAddress;
+    dev->int_in_ep_interval = int_in->bInterval;
+    dev->int_in_size = usb_endpoint_maxp(int_in);
+    dev->int_out_ep_addr = int_out->bEndpointAddress;
+    dev->int_out_ep_interval = int_out->bInterval;
+    dev->int_out_size = usb_endpoint_maxp(int_out);
+
+    ret = -ENOMEM;
+    dev->int_in_buf = kmalloc(dev->int_in_size, GFP_KERNEL);
+    if (dev->int_in_buf == NULL) {
+        printk(KERN_ERR "Could not allocate int_in_buf");
+        goto error;
+    }
+    dev->int_in_urb = usb_alloc_urb(0, GFP_KERNEL);
+    if (dev->int_in_urb == NULL) {
+        printk(KERN_ERR "Could not allocate int_in_urb\n");
+        goto error;
+    }
+
+    usb_fill_int_urb(dev->int_in_urb,
+            dev->udev,
+            usb_rcvintpipe(dev->udev,
+                dev->int_in_ep_addr),
+            dev->int_in_buf,
+            dev->int_in_size,
+            plug162_read_int_callback,
+            dev, dev->int_in_ep_interval);
+
+    plug162_read_caps(dev, interface);
 
     usb_set_intfdata(interface, dev);
-    ret = usb_register_dev(interface, &plug162_class);
-    if (ret == -EINVAL) {
+
+    mutex_lock(&plug162_idr_lock);
+    ret = idr_alloc(&plug162_idr, dev, 0, PLUG162_MAX_DEVICES, GFP_KERNEL);
+    mutex_unlock(&plug162_idr_lock);
+    if (ret < 0) {
         printk(KERN_DEBUG "Not able to get a minor for this device\n");
-        usb_set_intfdata(interface, NULL);
-        goto error;
+        goto error_intfdata;
+    }
+    dev->minor = ret;
+
+    dev->node = device_create(&plug162_class, &interface->dev,
+            MKDEV(MAJOR(plug162_devt), dev->minor), dev,
+            "plug162%d", dev->minor);
+    if (IS_ERR(dev->node)) {
+        ret = PTR_ERR(dev->node);
+        goto error_minor;
     }
 
+    plug162_debugfs_init(dev);
+
+    dev->probe_us = ktime_us_delta(ktime_get(), start);
+    trace_plug162_ready(dev->minor, PLUG162_READY_PROBED, dev->probe_us);
+
+    /*
+     * The device taking a PING marks it ready even if nobody opens the
+     * node. Its PONG matches no cookie and is ignored.
+     */
+    if (plug162_send_command(dev, ping, sizeof(ping), true) < 0)
+        printk(KERN_DEBUG "Could not send the readiness PING\n");
+
     dev_info(&interface->dev, 
         "USB Plug162 device now attached to USBPlug162-%d",
-        interface->minor);
+        dev->minor);
 
     return 0;
 
+error_minor:
+    mutex_lock(&plug162_idr_lock);
+    idr_remove(&plug162_idr, dev->minor);
+    mutex_unlock(&plug162_idr_lock);
+error_intfdata:
+    usb_set_intfdata(interface, NULL);
 error:
     if (dev)
         kref_put(&dev->kref, plug162_delete);
@@ -458,12 +2299,21 @@ error:
 static void plug162_disconnect(struct usb_interface *interface)
 {
     struct usb_plug162 *dev;
-    int minor = interface->minor;
+    int minor;
     
     dev = usb_get_intfdata(interface);
     usb_set_intfdata(interface, NULL);
+    minor = dev->minor;
 
-    usb_deregister_dev(interface, &plug162_class);
+    /* later opens fail; racing ones get -ENODEV from their I/O */
+    mutex_lock(&plug162_idr_lock);
+    idr_remove(&plug162_idr, minor);
+    mutex_unlock(&plug162_idr_lock);
+    device_destroy(&plug162_class, MKDEV(MAJOR(plug162_devt), minor));
+    debugfs_remove_recursive(dev->debugfs);
+
+    WRITE_ONCE(dev->gone, true);
+    synchronize_srcu(&plug162_srcu);
     
     mutex_lock(&dev->io_mutex);
     dev->interface = NULL;
@@ -471,19 +2321,37 @@ static void plug162_disconnect(struct usb_interface *interface)
 
     usb_kill_anchored_urbs(&dev->submitted);
     usb_kill_urb(dev->int_in_urb);
+    cancel_delayed_work_sync(&dev->recover_work);
+    cancel_delayed_work_sync(&dev->ping_work);
+    plug162_discard_anchor(dev, &dev->parked_urgent);
+    plug162_discard_anchor(dev, &dev->halted);
+    plug162_discard_anchor(dev, &dev->deferred);
+    plug162_fail_reads(dev, -ENODEV);
+    wake_up_interruptible_all(&dev->write_wait);
     
     kref_put(&dev->kref, plug162_delete);
     dev_info(&interface->dev, "USB Plug162 #%d now disconnected", minor);
 }
 
-static void plug162_draw_down(struct usb_plug162 *dev)
+/* returns true if writes had to be killed instead of completing */
+static bool plug162_draw_down(struct usb_plug162 *dev)
 {
     int time;
 
+    /*
+     * Called with io_mutex held. Later writers see the flag and take
+     * io_mutex: they park in deferred while suspended, and wait out a
+     * reset on the mutex.
+     */
+    WRITE_ONCE(dev->quiesced, true);
+    synchronize_srcu(&plug162_srcu);
+
     time = usb_wait_anchor_empty_timeout(&dev->submitted, 1000);
     if (!time)
         usb_kill_anchored_urbs(&dev->submitted);
     usb_kill_urb(dev->int_in_urb);
+
+    return !time;
 }
 
 static int plug162_suspend(struct usb_interface *intf, pm_message_t message)
@@ -492,13 +2360,44 @@ static int plug162_suspend(struct usb_interface *intf, pm_message_t message)
 
     if (dev == NULL)
         return 0;
+    cancel_delayed_work_sync(&dev->recover_work);
+    cancel_delayed_work_sync(&dev->ping_work);
+    mutex_lock(&dev->io_mutex);
     plug162_draw_down(dev);
+    mutex_unlock(&dev->io_mutex);
 
     return 0;
 }
 
 static int plug162_resume(struct usb_interface *intf)
 {
+    struct usb_plug162 *dev = usb_get_intfdata(intf);
+    int rv;
+
+    if (dev == NULL)
+        return 0;
+
+    mutex_lock(&dev->io_mutex);
+    WRITE_ONCE(dev->quiesced, false);
+    /* writes held back while suspended; after a halt, recovery sends them */
+    if (!test_bit(PLUG162_HALT_OUT, &dev->recover_flags)) {
+        plug162_resubmit_anchor(dev, &dev->parked_urgent);
+        plug162_resubmit_anchor(dev, &dev->deferred);
+    }
+    mutex_unlock(&dev->io_mutex);
+
+    /* a halted int-in urb is resubmitted by the recovery work instead */
+    if (dev->ongoing_read && !dev->in_error &&
+        !test_bit(PLUG162_HALT_IN, &dev->recover_flags)) {
+        rv = usb_submit_urb(dev->int_in_urb, GFP_NOIO);
+        if (rv < 0)
+            plug162_fail_reads(dev, rv);
+    }
+    if (dev->recover_flags)
+        schedule_delayed_work(&dev->recover_work, 0);
+    if (dev->ongoing_read)
+        plug162_start_pinging(dev);
+
     return 0;
 }
 
@@ -507,17 +2406,24 @@ static int plug162_pre_reset(struct usb_interface *intf)
     struct usb_plug162 *dev = usb_get_intfdata(intf);
 
     mutex_lock(&dev->io_mutex);
-    plug162_draw_down(dev);
+    dev->in_reset = true;
+    if (plug162_draw_down(dev))
+        atomic_set(&dev->errors, -EPIPE);
 
     return 0;
 }
 
+/*
+ * Writes parked by the recovery work and the int-in urb survive the
+ * reset; only writes that had to be killed are reported, as -EPIPE.
+ */
 static int plug162_post_reset(struct usb_interface *intf)
 {
     struct usb_plug162 *dev = usb_get_intfdata(intf);
 
-    /* we are sure no URBs are active - no locking needed */
-    dev->errors = -EPIPE;
+    plug162_resume_io(dev);
+    dev->in_reset = false;
+    WRITE_ONCE(dev->quiesced, false);
     mutex_unlock(&dev->io_mutex);
 
     return 0;
@@ -533,16 +2439,55 @@ static struct usb_driver plug162_driver = {
     .pre_reset =    plug162_pre_reset,
     .post_reset =   plug162_post_reset,
     .id_table = plug162_table,
+    .dev_groups =   plug162_groups,
     .supports_autosuspend = 1,
+    /* a slow plug must not hold up the others on the hub */
+    .driver = {
+        .probe_type =   PROBE_PREFER_ASYNCHRONOUS,
+    },
 };
 
 static int __init usb_plug162_init(void)
 {
     int result;
 
-    result = usb_register(&plug162_driver);
+    result = alloc_chrdev_region(&plug162_devt, 0, PLUG162_MAX_DEVICES,
+            "plug162");
+    if (result) {
+        printk(KERN_DEBUG "alloc_chrdev_region failed. Error number %d\n",
+            result);
+        return result;
+    }
+
+    result = class_register(&plug162_class);
+    if (result)
+        goto error_region;
+
+    plug162_debugfs_root = debugfs_create_dir("plug162", NULL);
+    debugfs_create_atomic_t("write_urbs", 0400, plug162_debugfs_root,
+            &plug162_write_urbs);
+
+    cdev_init(&plug162_cdev, &plug162_fops);
+    plug162_cdev.owner = THIS_MODULE;
+    result = cdev_add(&plug162_cdev, plug162_devt, PLUG162_MAX_DEVICES);
     if (result)
+        goto error_class;
+
+    result = usb_register(&plug162_driver);
+    if (result) {
         printk(KERN_DEBUG "usb_register failed. Error number %d\n", result);
+        goto error_cdev;
+    }
+
+    return 0;
+
+error_cdev:
+    cdev_del(&plug162_cdev);
+error_class:
+    debugfs_remove_recursive(plug162_debugfs_root);
+    class_unregister(&plug162_class);
+error_region:
+    unregister_chrdev_region(plug162_devt, PLUG162_MAX_DEVICES);
 
     return result;
 }
@@ -550,6 +2495,11 @@ static int __init usb_plug162_init(void)
 static void __exit usb_plug162_exit(void)
 {
     usb_deregister(&plug162_driver);
+    cdev_del(&plug162_cdev);
+    debugfs_remove_recursive(plug162_debugfs_root);
+    class_unregister(&plug162_class);
+    unregister_chrdev_region(plug162_devt, PLUG162_MAX_DEVICES);
+    idr_destroy(&plug162_idr);
 }
 
 module_init(usb_plug162_init);